@@ -1,5 +1,14 @@
 #include <unistd.h>
+#include <fcntl.h>
 #include <errno.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#ifdef __linux__
+#include <linux/tls.h>
+#endif
 #include "doorknob.h"
 #include "bearssl.h"
 #include "brssl.h"
@@ -24,74 +33,460 @@ int ssl_read_cert(const char *fname)
 	return 0;
 }
 
-static br_ssl_client_context sc;
-static br_x509_minimal_context mc;
-static unsigned char iobuf[BR_SSL_BUFSIZE_BIDI];
-static br_sslio_context ioc;
-static x509_noanchor_context xwc;
-static int sock_fd = -1;
+/* Session parameters from the last full handshake with each host, so
+ * later connections can resume the session rather than redo the
+ * RSA/ECDHE work.
+ */
+#define MAX_SESSIONS 8
+
+struct session_cache {
+	char host[256];
+	br_ssl_session_parameters params;
+};
+
+static struct session_cache sessions[MAX_SESSIONS];
+static int next_session;
+static char *session_file;   // the name within session_dir
+static int session_dir = -1; // opened before we drop privileges
+
+/* Everything BearSSL needs for one connection. */
+struct ssl_conn {
+	br_ssl_client_context sc;
+	br_x509_minimal_context mc;
+	unsigned char iobuf[BR_SSL_BUFSIZE_BIDI];
+	x509_noanchor_context xwc;
+	int sock;
+	int ready;
+	int ktls;                     // the kernel encrypts what we send
+	struct session_cache *cached; // the session we offered, if any
+	char host[256];
+};
 
-/* The read/write callbacks  cannot return 0. EOF is considered an error. */
-static int sock_read(void *ctx, unsigned char *buf, size_t len)
+static struct session_cache *session_find(const char *host)
 {
-	int rlen;
-	do
-		rlen = read(sock_fd, buf, len);
-	while (rlen < 0 && errno == EINTR);
-	if (rlen == 0)
-		return -1;
-	return rlen;
+	int i;
+
+	for (i = 0; i < MAX_SESSIONS; ++i)
+		if (strcmp(sessions[i].host, host) == 0)
+			return &sessions[i];
+
+	return NULL;
 }
 
-static int sock_write(void *ctx, const unsigned char *buf, size_t len)
+/* Called from read_config(), as root. The file holds the master
+ * secrets, and anyone who can plant one can skip the certificate
+ * checks, so both it and its directory must belong to owner and be
+ * private. The directory is kept open so the cache can still be
+ * written once privileges are dropped.
+ */
+int ssl_session_cache(const char *fname, uid_t owner)
 {
-	int wlen;
-	do
-		wlen = write(sock_fd, buf, len);
-	while (wlen < 0 && errno == EINTR);
-	if (wlen == 0)
-		return -1;
-	return wlen;
+	char dir[PATH_MAX];
+	struct stat sbuf;
+
+	strlcpy(dir, fname, sizeof(dir));
+	char *p = strrchr(dir, '/');
+	if (p == dir)
+		p[1] = 0;
+	else if (p)
+		*p = 0;
+	else
+		strcpy(dir, ".");
+	session_file = must_strdup(p ? fname + (p - dir) + 1 : fname);
+
+	session_dir = open(dir, O_RDONLY | O_DIRECTORY);
+	if (session_dir < 0)
+		return 1;
+	if (fstat(session_dir, &sbuf))
+		return 1;
+	if (sbuf.st_uid != owner || (sbuf.st_mode & 077)) {
+		logmsg("%s: must be owned by uid %d and mode 700", dir, (int)owner);
+		errno = EPERM;
+		return 1;
+	}
+
+	int fd = openat(session_dir, session_file, O_RDONLY | O_NOFOLLOW);
+	if (fd < 0)
+		return errno == ENOENT ? 0 : 1;
+
+	struct session_cache cache[MAX_SESSIONS];
+	int n = -1;
+	if (fstat(fd, &sbuf) == 0 && S_ISREG(sbuf.st_mode) &&
+		sbuf.st_uid == owner && (sbuf.st_mode & 077) == 0)
+		n = read(fd, cache, sizeof(cache));
+	else
+		logmsg("%s: not owned by uid %d or not private, ignored", fname, (int)owner);
+	close(fd);
+
+	// A cache from a different build is just ignored
+	if (n == sizeof(cache))
+		memcpy(sessions, cache, sizeof(sessions));
+
+	return 0;
+}
+
+static void session_write(void)
+{
+	char tmp[NAME_MAX + 1];
+
+	strconcat(tmp, sizeof(tmp), session_file, ".tmp", NULL);
+
+	int flags = O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW;
+	int fd = openat(session_dir, tmp, flags, 0600);
+	if (fd < 0 && errno == EEXIST) {
+		// Left over from a crash
+		unlinkat(session_dir, tmp, 0);
+		fd = openat(session_dir, tmp, flags, 0600);
+	}
+	if (fd < 0) {
+		logmsg("%s: %s", tmp, strerror(errno));
+		return;
+	}
+
+	int n = write(fd, sessions, sizeof(sessions));
+	close(fd);
+
+	if (n != sizeof(sessions) || renameat(session_dir, tmp, session_dir, session_file)) {
+		logmsg("%s: write failed", session_file);
+		unlinkat(session_dir, tmp, 0);
+	}
 }
 
-int ssl_open(int sock, const char *host)
+/* The handshake is done, remember the session for next time */
+static void session_save(struct ssl_conn *ssl)
 {
-	br_ssl_client_init_full(&sc, &mc, &VEC_ELT(anchors, 0), VEC_LEN(anchors));
+	br_ssl_session_parameters params;
+
+	br_ssl_engine_get_session_parameters(&ssl->sc.eng, &params);
+
+	if (ssl->cached &&
+		params.session_id_len == ssl->cached->params.session_id_len &&
+		memcmp(params.session_id, ssl->cached->params.session_id, params.session_id_len) == 0) {
+		metric_add(M_TLS_RESUMED, 1);
+		return;
+	}
+
+	metric_add(M_TLS_FULL, 1);
+
+	if (params.session_id_len == 0)
+		return; // server does not do session ids
+
+	struct session_cache *cache = ssl->cached;
+	if (!cache) {
+		cache = &sessions[next_session];
+		next_session = (next_session + 1) % MAX_SESSIONS;
+	}
+
+	strlcpy(cache->host, ssl->host, sizeof(cache->host));
+	cache->params = params;
+
+	if (session_dir >= 0)
+		session_write();
+}
+
+/* The socket must be non-blocking. This only starts the handshake,
+ * ssl_pump() does the rest.
+ */
+struct ssl_conn *ssl_open(int sock, const char *host)
+{
+	struct ssl_conn *ssl = calloc(1, sizeof(struct ssl_conn));
+	if (!ssl) {
+		logmsg("Out of memory!");
+		return NULL;
+	}
+
+	br_ssl_client_init_full(&ssl->sc, &ssl->mc, &VEC_ELT(anchors, 0), VEC_LEN(anchors));
 
 	if (VEC_LEN(anchors) == 0) {
 		logmsg("Warning: No cert");
-		x509_noanchor_init(&xwc, &mc.vtable);
-		br_ssl_engine_set_x509(&sc.eng, &xwc.vtable);
+		x509_noanchor_init(&ssl->xwc, &ssl->mc.vtable);
+		br_ssl_engine_set_x509(&ssl->sc.eng, &ssl->xwc.vtable);
 	}
 
-	br_ssl_engine_set_buffer(&sc.eng, iobuf, sizeof iobuf, 1);
+	br_ssl_engine_set_buffer(&ssl->sc.eng, ssl->iobuf, sizeof(ssl->iobuf), 1);
 
-	if (br_ssl_client_reset(&sc, host, 0) == 0)
-		return 1;
+	strlcpy(ssl->host, host, sizeof(ssl->host));
+	ssl->cached = session_find(host);
+	if (ssl->cached)
+		br_ssl_engine_set_session_parameters(&ssl->sc.eng, &ssl->cached->params);
+
+	if (br_ssl_client_reset(&ssl->sc, host, ssl->cached != NULL) == 0) {
+		free(ssl);
+		return NULL;
+	}
 
-	sock_fd = sock;
-	br_sslio_init(&ioc, &sc.eng, sock_read, &sock_fd, sock_write, &sock_fd);
+	ssl->sock = sock;
 
-	return 0;
+	return ssl;
 }
 
-int ssl_read(char *buffer, int len)
+/* Move records between the engine and the socket until one of them
+ * would block. Returns the poll events needed to make more progress,
+ * or -1 if the connection failed or was closed.
+ */
+int ssl_pump(struct ssl_conn *ssl)
 {
-	return br_sslio_read(&ioc, buffer, len);
+	br_ssl_engine_context *eng = &ssl->sc.eng;
+	unsigned char *buf;
+	size_t len;
+	int n, want;
+
+	do {
+		unsigned state = br_ssl_engine_current_state(eng);
+		if (state == BR_SSL_CLOSED)
+			return -1;
+
+		want = 0;
+		n = 0;
+
+		if (state & BR_SSL_SENDREC) {
+			// An alert or renegotiation, the keys are not ours anymore
+			if (ssl->ktls)
+				return -1;
+			buf = br_ssl_engine_sendrec_buf(eng, &len);
+			n = write(ssl->sock, buf, len);
+			if (n > 0)
+				br_ssl_engine_sendrec_ack(eng, n);
+			else if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+				want |= POLLOUT;
+			else
+				return -1;
+		}
+
+		if (n <= 0 && (state & BR_SSL_RECVREC)) {
+			buf = br_ssl_engine_recvrec_buf(eng, &len);
+			n = read(ssl->sock, buf, len);
+			if (n > 0)
+				br_ssl_engine_recvrec_ack(eng, n);
+			else if (n == 0)
+				return -1; // EOF
+			else if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+				want |= POLLIN;
+			else
+				return -1;
+		}
+	} while (n > 0);
+
+	return want;
 }
 
-int ssl_write(const char *buffer, int len)
+#if defined(__linux__) && defined(TLS_TX)
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+
+/* Hand the client write keys to the kernel. Only the sending side is
+ * offloaded, BearSSL still decrypts the replies. This must be called
+ * before any application data goes out: our Finished was record 0 so
+ * the kernel starts at 1.
+ */
+static void ktls_start(struct ssl_conn *ssl)
 {
-	int rc = br_sslio_write_all(&ioc, buffer, len);
-	br_sslio_flush(&ioc);
-	return rc == 0 ? len : -1;
+	br_ssl_engine_context *eng = &ssl->sc.eng;
+	br_ssl_session_parameters params;
+	unsigned char block[2 * (32 + 12)];
+	union {
+		struct tls12_crypto_info_aes_gcm_128 gcm128;
+		struct tls12_crypto_info_aes_gcm_256 gcm256;
+		struct tls12_crypto_info_chacha20_poly1305 chacha;
+	} info;
+	unsigned key_len, iv_len, sha384 = 0;
+	size_t info_len = 0;
+
+	br_ssl_engine_get_session_parameters(eng, &params);
+	if (params.version != BR_TLS12)
+		return;
+
+	switch (params.cipher_suite) {
+	case BR_TLS_RSA_WITH_AES_256_GCM_SHA384:
+	case BR_TLS_ECDHE_ECDSA_WITH_AES_256_GCM_SHA384:
+	case BR_TLS_ECDH_ECDSA_WITH_AES_256_GCM_SHA384:
+	case BR_TLS_ECDHE_RSA_WITH_AES_256_GCM_SHA384:
+	case BR_TLS_ECDH_RSA_WITH_AES_256_GCM_SHA384:
+		key_len = 32;
+		iv_len = 4;
+		sha384 = 1;
+		break;
+	case BR_TLS_RSA_WITH_AES_128_GCM_SHA256:
+	case BR_TLS_ECDHE_ECDSA_WITH_AES_128_GCM_SHA256:
+	case BR_TLS_ECDH_ECDSA_WITH_AES_128_GCM_SHA256:
+	case BR_TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256:
+	case BR_TLS_ECDH_RSA_WITH_AES_128_GCM_SHA256:
+		key_len = 16;
+		iv_len = 4;
+		break;
+#ifdef TLS_CIPHER_CHACHA20_POLY1305
+	case BR_TLS_ECDHE_RSA_WITH_CHACHA20_POLY1305_SHA256:
+	case BR_TLS_ECDHE_ECDSA_WITH_CHACHA20_POLY1305_SHA256:
+		key_len = 32;
+		iv_len = 12;
+		break;
+#endif
+	default:
+		return; // stay with BearSSL
+	}
+
+	/* RFC 5246 6.3: AEAD suites have no MAC keys, so the key block is
+	 * client key, server key, client iv, server iv.
+	 */
+	br_tls_prf_seed_chunk seed[2] = {
+		{ eng->server_random, sizeof(eng->server_random) },
+		{ eng->client_random, sizeof(eng->client_random) },
+	};
+	(sha384 ? br_tls12_sha384_prf : br_tls12_sha256_prf)
+		(block, 2 * (key_len + iv_len), params.master_secret,
+		 sizeof(params.master_secret), "key expansion", 2, seed);
+	unsigned char *key = block, *iv = block + 2 * key_len;
+
+	// The sequence number, also used as the explicit GCM nonce
+	unsigned char seq[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+
+	memset(&info, 0, sizeof(info));
+	if (iv_len == 12) {
+#ifdef TLS_CIPHER_CHACHA20_POLY1305
+		info.chacha.info.version = TLS_1_2_VERSION;
+		info.chacha.info.cipher_type = TLS_CIPHER_CHACHA20_POLY1305;
+		memcpy(info.chacha.key, key, key_len);
+		memcpy(info.chacha.iv, iv, iv_len);
+		memcpy(info.chacha.rec_seq, seq, sizeof(seq));
+		info_len = sizeof(info.chacha);
+#endif
+	} else if (key_len == 32) {
+		info.gcm256.info.version = TLS_1_2_VERSION;
+		info.gcm256.info.cipher_type = TLS_CIPHER_AES_GCM_256;
+		memcpy(info.gcm256.key, key, key_len);
+		memcpy(info.gcm256.salt, iv, iv_len);
+		memcpy(info.gcm256.iv, seq, sizeof(seq));
+		memcpy(info.gcm256.rec_seq, seq, sizeof(seq));
+		info_len = sizeof(info.gcm256);
+	} else {
+		info.gcm128.info.version = TLS_1_2_VERSION;
+		info.gcm128.info.cipher_type = TLS_CIPHER_AES_GCM_128;
+		memcpy(info.gcm128.key, key, key_len);
+		memcpy(info.gcm128.salt, iv, iv_len);
+		memcpy(info.gcm128.iv, seq, sizeof(seq));
+		memcpy(info.gcm128.rec_seq, seq, sizeof(seq));
+		info_len = sizeof(info.gcm128);
+	}
+
+	// If the tls module is missing we just keep going with BearSSL
+	if (setsockopt(ssl->sock, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) == 0 &&
+		setsockopt(ssl->sock, SOL_TLS, TLS_TX, &info, info_len) == 0)
+		ssl->ktls = 1;
+
+	memset(block, 0, sizeof(block));
+	memset(&info, 0, sizeof(info));
+	memset(&params, 0, sizeof(params));
+}
+#else
+#define ktls_start(ssl)
+#endif
+
+/* Returns non-zero once the handshake is done and our last handshake
+ * record has gone out.
+ */
+int ssl_ready(struct ssl_conn *ssl)
+{
+	unsigned state = br_ssl_engine_current_state(&ssl->sc.eng);
+
+	if (!(state & (BR_SSL_SENDAPP | BR_SSL_RECVAPP)))
+		return 0;
+
+	if (!ssl->ready) {
+		if (state & BR_SSL_SENDREC)
+			return 0; // still flushing our Finished
+		ssl->ready = 1;
+		session_save(ssl);
+		ktls_start(ssl);
+	}
+
+	return 1;
 }
 
-void ssl_close(void)
+/* Returns non-zero if sends bypass BearSSL */
+int ssl_ktls(struct ssl_conn *ssl)
 {
-	if (br_ssl_engine_current_state(&sc.eng) == BR_SSL_CLOSED) {
-		int err = br_ssl_engine_last_error(&sc.eng);
-		if (err)
+	return ssl->ktls;
+}
+
+/* Like read() on a non-blocking socket */
+int ssl_read(struct ssl_conn *ssl, char *buffer, int len)
+{
+	br_ssl_engine_context *eng = &ssl->sc.eng;
+	unsigned state = br_ssl_engine_current_state(eng);
+	unsigned char *buf;
+	size_t alen;
+
+	if (state & BR_SSL_RECVAPP) {
+		buf = br_ssl_engine_recvapp_buf(eng, &alen);
+		if (alen > len)
+			alen = len;
+		memcpy(buffer, buf, alen);
+		br_ssl_engine_recvapp_ack(eng, alen);
+		return alen;
+	}
+
+	if (state == BR_SSL_CLOSED)
+		return 0;
+
+	errno = EAGAIN;
+	return -1;
+}
+
+/* Like write() on a non-blocking socket. The data is buffered in the
+ * engine and only goes out, via ssl_pump(), when it fills a record or
+ * on ssl_flush(). With kTLS it goes straight to the socket.
+ */
+int ssl_write(struct ssl_conn *ssl, const char *buffer, int len)
+{
+	br_ssl_engine_context *eng = &ssl->sc.eng;
+	unsigned state = br_ssl_engine_current_state(eng);
+	unsigned char *buf;
+	size_t alen;
+
+	if (ssl->ktls)
+		return write(ssl->sock, buffer, len);
+
+	if (state & BR_SSL_SENDAPP) {
+		buf = br_ssl_engine_sendapp_buf(eng, &alen);
+		if (alen > len)
+			alen = len;
+		memcpy(buf, buffer, alen);
+		br_ssl_engine_sendapp_ack(eng, alen);
+		return alen;
+	}
+
+	if (state == BR_SSL_CLOSED) {
+		errno = EPIPE;
+		return -1;
+	}
+
+	errno = EAGAIN;
+	return -1;
+}
+
+/* Close off the current record so it can be sent */
+void ssl_flush(struct ssl_conn *ssl)
+{
+	if (!ssl->ktls)
+		br_ssl_engine_flush(&ssl->sc.eng, 0);
+}
+
+/* Does not close the socket. */
+void ssl_close(struct ssl_conn *ssl)
+{
+	if (br_ssl_engine_current_state(&ssl->sc.eng) == BR_SSL_CLOSED) {
+		int err = br_ssl_engine_last_error(&ssl->sc.eng);
+		if (err) {
 			logmsg("SSL error %d", err);
+			// Don't offer a session that may be the problem again
+			if (ssl->cached && !ssl->ready)
+				memset(ssl->cached, 0, sizeof(struct session_cache));
+		}
 	}
+
+	free(ssl);
 }
@@ -0,0 +1,62 @@
+/* bench.h - timing and reporting shared by the benchmarks
+ *
+ * Each benchmark is built from its own single source file, so these
+ * are static inline rather than a library.
+ */
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdio.h>
+#include <time.h>
+#include <sys/resource.h>
+
+static inline double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static inline double cpu(void)
+{
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+		ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+/* One case of a per-message benchmark as key=value pairs */
+static inline void bench_report(const char *bench, const char *name,
+								int msg_bytes, long msgs, double secs)
+{
+	double bytes = (double)msg_bytes * msgs;
+
+	printf("%s %-22s msg_bytes=%d msgs=%ld secs=%.3f ns/byte=%.3f msgs/s=%.0f\n",
+		   bench, name, msg_bytes, msgs, secs, secs * 1e9 / bytes, msgs / secs);
+}
+
+/* The header of a message as a cron job hands it to sendmail, less
+ * the To: line and the blank line so callers can add recipients.
+ */
+#define BENCH_HEADER \
+	"Date: Mon, 17 Jul 2017 12:00:00 -0400\n" \
+	"Message-ID: <1500000000.123456.1234@mail.example.com>\n" \
+	"MIME-Version: 1.0\n" \
+	"Content-Type: text/plain; charset=utf-8\n" \
+	"Content-Transfer-Encoding: 8bit\n" \
+	"X-Mailer: cron\n" \
+	"X-Cron-Env: <SHELL=/bin/sh>\n" \
+	"X-Cron-Env: <HOME=/root>\n" \
+	"X-Cron-Env: <PATH=/usr/bin:/bin>\n" \
+	"X-Cron-Env: <LOGNAME=root>\n" \
+	"Subject: Cron <root@mail> /usr/local/bin/backup --verbose --all\n" \
+	"From: Cron Daemon <root@mail.example.com>\n"
+
+/* Fills len bytes with 76 column lines of text */
+static inline void bench_body(char *body, int len)
+{
+	for (int i = 0; i < len; ++i)
+		body[i] = (i % 77) == 76 ? '\n' : 'a' + i % 26;
+}
+
+#endif
@@ -0,0 +1,150 @@
+/* body.c - compare the body copy loop with sendfile
+ *
+ * Writes a spool sized file and pushes it over a loopback TCP
+ * connection, once through a read/write copy loop with the old 4k
+ * stdio buffer and the current 16k session buffer, and once with
+ * sendfile(). A child drains the socket.
+ *
+ * usage: bench/body [megabytes] [iterations]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "bench.h"
+
+static int make_spool(size_t size)
+{
+	char fname[] = "/tmp/bench-body-XXXXXX";
+	int fd = mkstemp(fname);
+	if (fd < 0) {
+		perror("mkstemp");
+		exit(1);
+	}
+	unlink(fname);
+
+	char line[80];
+	memset(line, 'x', sizeof(line) - 2);
+	line[78] = '\r';
+	line[79] = '\n';
+	for (size_t n = 0; n < size; n += sizeof(line))
+		if (write(fd, line, sizeof(line)) != sizeof(line)) {
+			perror("write");
+			exit(1);
+		}
+
+	return fd;
+}
+
+/* Returns a connected socket, the other end is drained by a child */
+static int make_sink(pid_t *pid)
+{
+	struct sockaddr_in sin = { .sin_family = AF_INET };
+	socklen_t len = sizeof(sin);
+	int lsock = socket(AF_INET, SOCK_STREAM, 0);
+
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(lsock, (struct sockaddr *)&sin, sizeof(sin)) ||
+		listen(lsock, 1) ||
+		getsockname(lsock, (struct sockaddr *)&sin, &len)) {
+		perror("listen");
+		exit(1);
+	}
+
+	*pid = fork();
+	if (*pid == 0) {
+		static char buf[65536];
+		int sock = accept(lsock, NULL, NULL);
+		while (read(sock, buf, sizeof(buf)) > 0) ;
+		_exit(0);
+	}
+	close(lsock);
+
+	int sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (connect(sock, (struct sockaddr *)&sin, sizeof(sin))) {
+		perror("connect");
+		exit(1);
+	}
+	return sock;
+}
+
+static void do_copy(int sock, int fd, size_t size, size_t bufsize)
+{
+	FILE *fp = fdopen(dup(fd), "r");
+	char *buf = malloc(bufsize);
+	size_t n;
+
+	setvbuf(fp, NULL, _IOFBF, bufsize);
+	rewind(fp);
+	while ((n = fread(buf, 1, bufsize, fp)) > 0)
+		for (size_t off = 0; off < n; ) {
+			ssize_t w = write(sock, buf + off, n - off);
+			if (w <= 0) {
+				perror("write");
+				exit(1);
+			}
+			off += w;
+		}
+
+	fclose(fp);
+	free(buf);
+}
+
+static void do_sendfile(int sock, int fd, size_t size)
+{
+	off_t off = 0;
+
+	while (off < size)
+		if (sendfile(sock, fd, &off, size - off) <= 0) {
+			perror("sendfile");
+			exit(1);
+		}
+}
+
+static void run(const char *name, int fd, size_t size, int iters, size_t bufsize)
+{
+	pid_t pid;
+	int sock = make_sink(&pid);
+
+	double start = now(), cstart = cpu();
+	for (int i = 0; i < iters; ++i)
+		if (bufsize)
+			do_copy(sock, fd, size, bufsize);
+		else
+			do_sendfile(sock, fd, size);
+	double secs = now() - start, csecs = cpu() - cstart;
+
+	close(sock);
+	waitpid(pid, NULL, 0);
+
+	double bytes = (double)size * iters;
+	printf("body %-9s bytes=%.0f secs=%.3f MB/s=%.1f cpu_ns/byte=%.3f\n",
+		   name, bytes, secs, bytes / secs / 1e6, csecs * 1e9 / bytes);
+}
+
+int main(int argc, char *argv[])
+{
+	size_t size = (argc > 1 ? strtoul(argv[1], NULL, 0) : 8) << 20;
+	int iters = argc > 2 ? strtol(argv[2], NULL, 0) : 10;
+
+	signal(SIGPIPE, SIG_IGN);
+
+	int fd = make_spool(size);
+
+	run("copy-4k", fd, size, iters, 4096);
+	run("copy-16k", fd, size, iters, 16384);
+	run("sendfile", fd, size, iters, 0);
+
+	close(fd);
+	return 0;
+}
@@ -0,0 +1,269 @@
+/* deliver.c - the per-byte work doorknob does for a message
+ *
+ * Times read_callback() over a synthetic spool file, as body_fill()
+ * drives it, with and without rewrite-from, and the base64 encoding
+ * done for AUTH. The spool is in memory so only the CPU cost shows;
+ * bench/body covers getting the bytes onto the socket.
+ *
+ * Then whole messages through one session, as the poll loop drives
+ * it, to a canned server on the other end of a socketpair, at -d
+ * levels 0, 1 and 2. The log goes to a file and is flushed once a
+ * pass, so this shows what the protocol traces cost a delivery. At
+ * level 2 the body is traced, which turns off sendfile.
+ *
+ * Each line of output is one case as key=value pairs.
+ *
+ * usage: bench/deliver [seconds]
+ */
+#define main doorknob_main
+#include "../doorknob.c"
+#undef main
+
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "bench.h"
+
+static double min_secs = 0.5;
+
+/* A header about the size of a real one and a body of 76 column
+ * lines, as it sits in the spool after the recipients.
+ */
+static char *make_message(int body_len, int *len)
+{
+	static const char header[] =
+		"Received: from localhost (localhost [127.0.0.1])\n"
+		"\tby mail.example.com (doorknob) with SMTP id 1500000000.123456.1234\n"
+		"\tfor <fred@example.com>; Mon, 17 Jul 2017 12:00:00 -0400\n"
+		BENCH_HEADER
+		"To: Fred Flintstone <fred@example.com>\n"
+		"\n";
+	int hlen = sizeof(header) - 1;
+
+	char *msg = malloc(hlen + body_len + 1);
+	if (!msg) {
+		perror("malloc");
+		exit(1);
+	}
+	memcpy(msg, header, hlen);
+	bench_body(msg + hlen, body_len);
+	msg[hlen + body_len] = 0;
+
+	*len = hlen + body_len;
+	return msg;
+}
+
+static void bench_read_callback(const char *name, int body_len, int rewrite)
+{
+	static struct smtp s;
+	int len;
+	long msgs = 0;
+	double secs;
+
+	char *msg = make_message(body_len, &len);
+
+	double start = now();
+	do {
+		FILE *fp = fmemopen(msg, len, "r");
+		if (!fp) {
+			perror("fmemopen");
+			exit(1);
+		}
+
+		int n, total = 0;
+		s.looking_for_from = rewrite;
+		while ((n = read_callback(&s, s.obuf, sizeof(s.obuf), fp)) > 0)
+			total += n;
+		fclose(fp);
+
+		if (total < len - 64) {
+			fprintf(stderr, "%s: short read %d of %d\n", name, total, len);
+			exit(1);
+		}
+		++msgs;
+	} while ((secs = now() - start) < min_secs);
+
+	bench_report("deliver", name, len, msgs, secs);
+	free(msg);
+}
+
+static void bench_base64(const char *name, int len)
+{
+	uint8_t src[1024];
+	char dst[1500];
+	long msgs = 0;
+	double secs;
+	int i;
+
+	for (i = 0; i < len; ++i)
+		src[i] = i * 7;
+
+	double start = now();
+	do {
+		for (i = 0; i < 1000; ++i)
+			base64_encode(dst, sizeof(dst), src, len);
+		msgs += 1000;
+	} while ((secs = now() - start) < min_secs);
+
+	bench_report("deliver", name, len, msgs, secs);
+}
+
+static void bench_authplain(void)
+{
+	char plain[256];
+	long msgs = 0;
+	double secs;
+	int i;
+
+	double start = now();
+	do {
+		for (i = 0; i < 1000; ++i)
+			mkauthplain("fred@example.com", "correct horse battery staple",
+						plain, sizeof(plain));
+		msgs += 1000;
+	} while ((secs = now() - start) < min_secs);
+
+	// user \0 user \0 passwd
+	bench_report("deliver", "mkauthplain", 16 + 1 + 16 + 1 + 28, msgs, secs);
+}
+
+/* The other end of the session: 250 to everything, 354 to DATA */
+static void canned_server(int sock)
+{
+	FILE *in = fdopen(sock, "r");
+	char line[1024];
+	int data = 0;
+
+	while (fgets(line, sizeof(line), in)) {
+		const char *reply;
+
+		if (data) {
+			if (strcmp(line, ".\r\n"))
+				continue;
+			data = 0;
+			reply = "250 queued\r\n";
+		} else if (strncmp(line, "DATA", 4) == 0) {
+			data = 1;
+			reply = "354 go\r\n";
+		} else
+			reply = "250 ok\r\n";
+		if (write(sock, reply, strlen(reply)) < 0)
+			break;
+	}
+	_exit(0);
+}
+
+static void bench_session(const char *name, int body_len, int level)
+{
+	static const char rcpts[] = "fred@example.com\nbarney@example.com\nwilma@example.com\n\n";
+	static struct smtp s;
+	char spool[] = "/tmp/bench-deliver-XXXXXX", fname[sizeof(spool) + 2];
+	int sv[2], len;
+	long msgs = 0;
+	double secs = 0;
+
+	char *msg = make_message(body_len, &len);
+	int fd = mkstemp(spool);
+	if (fd < 0 || write(fd, rcpts, sizeof(rcpts) - 1) < 0 || write(fd, msg, len) != len) {
+		perror(spool);
+		exit(1);
+	}
+	close(fd);
+	free(msg);
+	len += sizeof(rcpts) - 1;
+	snprintf(fname, sizeof(fname), "%s.q", spool);
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+		perror("socketpair");
+		exit(1);
+	}
+	pid_t pid = fork();
+	if (pid == 0) {
+		close(sv[0]);
+		canned_server(sv[1]);
+	}
+	close(sv[1]);
+	fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK);
+
+	FILE *log = tmpfile();
+	int saved = dup(2);
+	if (!log || saved < 0) {
+		perror("tmpfile");
+		exit(1);
+	}
+	dup2(fileno(log), 2);
+	log_to_stderr();
+	debug = level;
+
+	memset(&s, 0, sizeof(s));
+	s.sock = sv[0];
+	s.srv = &servers[0];
+	s.srv->host = "bench";
+	s.pipelining = 1;
+	s.state = S_READY;
+
+	double start = now();
+	do {
+		// Delivery unlinks it
+		if (link(spool, fname)) {
+			perror(fname);
+			exit(1);
+		}
+		s.fname = fname;
+		s.sent = 0; // no RSET, and nothing for session_fail() to reconnect
+		if (msg_start(&s))
+			break;
+		while (s.state != S_READY && s.state != S_IDLE) {
+			struct pollfd pfd = { .fd = s.sock, .events = session_events(&s) };
+			poll(&pfd, 1, 1000);
+			session_step(&s);
+			log_flush();
+		}
+		if (s.state != S_READY)
+			break;
+		++msgs;
+
+		// Keep the log from filling /tmp
+		if (lseek(2, 0, SEEK_CUR) > 16 << 20 && (ftruncate(2, 0) || lseek(2, 0, SEEK_SET)))
+			break;
+	} while ((secs = now() - start) < min_secs);
+
+	debug = 0;
+	dup2(saved, 2);
+	close(saved);
+	fclose(log);
+	close(sv[0]);
+	waitpid(pid, NULL, 0);
+	unlink(spool);
+
+	if (s.state != S_READY) {
+		unlink(fname);
+		fprintf(stderr, "%s: session failed\n", name);
+		exit(1);
+	}
+	bench_report("deliver", name, len, msgs, secs);
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc > 1)
+		min_secs = strtod(argv[1], NULL);
+
+	mail_from = "doorknob@example.com";
+
+	bench_read_callback("read_callback-2k", 2048, 0);
+	bench_read_callback("read_callback-64k", 65536, 0);
+	bench_read_callback("read_callback-from-2k", 2048, 1);
+	bench_read_callback("read_callback-from-64k", 65536, 1);
+	bench_base64("base64_encode-48", 48);
+	bench_base64("base64_encode-1k", 1024);
+	bench_authplain();
+	bench_session("session-2k-debug0", 2048, 0);
+	bench_session("session-2k-debug1", 2048, 1);
+	bench_session("session-2k-debug2", 2048, 2);
+	bench_session("session-64k-debug0", 65536, 0);
+	bench_session("session-64k-debug1", 65536, 1);
+	bench_session("session-64k-debug2", 65536, 2);
+
+	return 0;
+}
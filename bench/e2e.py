@@ -0,0 +1,276 @@
+#!/usr/bin/env python3
+"""e2e.py - end to end throughput of sendmail, doorknob and a sink
+
+Builds doorknob and sendmail against a scratch MAILDIR and config,
+starts bench/smtp-sink.py on a local port, runs doorknob in the
+foreground without dropping privileges (-C), and then fires off
+sendmail -t as many times as asked, that many at once. It needs no
+root and no network.
+
+It prints key=value lines like the other benches: the enqueue and
+delivery rates, the enqueue to accept latency percentiles (from an
+X-Bench-Sent header the sink reads back), and the CPU time and peak
+RSS of sendmail, doorknob and the sink.
+
+starttls and smtps need doorknob built with BearSSL, pass BEARDIR.
+The sink gets a throwaway self signed certificate for localhost,
+which doorknob is given as its cert so it is verified.
+
+usage: bench/e2e.py [--mode plain|starttls|smtps] [--messages N]
+                    [--concurrency N] [--workers N] [--body BYTES]
+"""
+import argparse
+import os
+import shutil
+import signal
+import socket
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+BENCH = os.path.dirname(os.path.abspath(__file__))
+TOP = os.path.dirname(BENCH)
+
+
+def run(cmd, **kw):
+    r = subprocess.run(cmd, stdout=subprocess.PIPE, stderr=subprocess.STDOUT, **kw)
+    if r.returncode:
+        sys.exit('%s failed:\n%s' % (' '.join(cmd), r.stdout.decode(errors='replace')))
+
+
+def build(tmp, args):
+    src = os.path.join(tmp, 'src')
+    os.mkdir(src)
+    for f in os.listdir(TOP):
+        if f.endswith(('.c', '.h')) or f == 'Makefile':
+            shutil.copy(os.path.join(TOP, f), src)
+    make = ['make', '-C', src,
+            'MAILDIR=' + os.path.join(tmp, 'spool'),
+            'CONFIGFILE=' + os.path.join(tmp, 'doorknob.conf')]
+    if args.mode == 'plain' and not args.bear:
+        make.append('USE_BEAR=0')
+    elif args.bear:
+        make.append('BEARDIR=' + os.path.abspath(args.bear))
+    else:
+        sys.exit('%s needs doorknob built with BearSSL, pass --bear or BEARDIR' % args.mode)
+    run(make + ['doorknob', 'sendmail'])
+    return src
+
+
+def make_cert(tmp):
+    cert, key = os.path.join(tmp, 'cert.pem'), os.path.join(tmp, 'key.pem')
+    run(['openssl', 'req', '-x509', '-newkey', 'rsa:2048', '-nodes', '-days', '1',
+         '-subj', '/CN=localhost', '-addext', 'subjectAltName=DNS:localhost',
+         '-keyout', key, '-out', cert])
+    return cert, key
+
+
+def free_port():
+    s = socket.socket()
+    s.bind(('127.0.0.1', 0))
+    port = s.getsockname()[1]
+    s.close()
+    return port
+
+
+def wait_port(port, secs=5):
+    end = time.time() + secs
+    while time.time() < end:
+        try:
+            socket.create_connection(('127.0.0.1', port), 0.2).close()
+            return
+        except OSError:
+            time.sleep(0.05)
+    sys.exit('sink did not start')
+
+
+def write_config(tmp, args, port, cert, extra=()):
+    scheme = 'smtps' if args.mode == 'smtps' else 'smtp'
+    with open(os.path.join(tmp, 'doorknob.conf'), 'w') as f:
+        f.write('smtp-server %s://localhost:%d\n' % (scheme, port))
+        if args.mode == 'starttls':
+            f.write('starttls\n')
+        if cert:
+            f.write('cert %s\n' % cert)
+        f.write('smtp-user bench\nsmtp-password bench\n')
+        f.write('mail-from bench@example.com\n')
+        f.write('workers %d\n' % args.workers)
+        for line in extra:
+            f.write(line + '\n')
+
+
+def proc_usage(pid):
+    """CPU seconds and peak RSS in KB of a live process"""
+    with open('/proc/%d/stat' % pid) as f:
+        fields = f.read().rsplit(')', 1)[1].split()
+    ticks = os.sysconf('SC_CLK_TCK')
+    cpu = (int(fields[11]) + int(fields[12])) / ticks
+    rss = 0
+    with open('/proc/%d/status' % pid) as f:
+        for line in f:
+            if line.startswith('VmHWM:'):
+                rss = int(line.split()[1])
+    return cpu, rss
+
+
+class Senders:
+    """Runs sendmail -t, concurrency at a time, and keeps the rusage"""
+
+    def __init__(self, sendmail, args):
+        self.sendmail = sendmail
+        self.args = args
+        self.lock = threading.Lock()
+        self.next = 0
+        self.failed = 0
+        self.cpu = 0.0
+        self.maxrss = 0
+        self.body = ('x' * 75 + '\n') * max(1, args.body // 76)
+
+    def one(self, i):
+        msg = ('To: user%d@example.com\nSubject: bench %d\nX-Bench-Sent: %.6f\n\n%s' %
+               (i, i, time.time(), self.body)).encode()
+        p = subprocess.Popen([self.sendmail, '-t'], stdin=subprocess.PIPE,
+                             stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        p.stdin.write(msg)
+        p.stdin.close()
+        _, status, ru = os.wait4(p.pid, 0)
+        p.returncode = status
+        with self.lock:
+            self.cpu += ru.ru_utime + ru.ru_stime
+            self.maxrss = max(self.maxrss, ru.ru_maxrss)
+            if status:
+                self.failed += 1
+
+    def worker(self):
+        while True:
+            with self.lock:
+                i = self.next
+                if i >= self.args.messages:
+                    return
+                self.next += 1
+            self.one(i)
+
+    def run(self):
+        threads = [threading.Thread(target=self.worker) for _ in range(self.args.concurrency)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+
+
+def read_events(path):
+    """The sink log as (time, event, sent, bytes) tuples"""
+    try:
+        with open(path) as f:
+            return [line.split() for line in f]
+    except FileNotFoundError:
+        return []
+
+
+def count_accepted(path):
+    return sum(1 for e in read_events(path) if e[1] == 'accept')
+
+
+def percentile(sorted_vals, q):
+    if not sorted_vals:
+        return 0
+    return sorted_vals[min(len(sorted_vals) - 1, int(q * len(sorted_vals)))]
+
+
+def main():
+    p = argparse.ArgumentParser(description='doorknob end to end load test')
+    p.add_argument('--mode', choices=('plain', 'starttls', 'smtps'), default='plain')
+    p.add_argument('--messages', type=int, default=2000)
+    p.add_argument('--concurrency', type=int, default=200, help='sendmails at once')
+    p.add_argument('--workers', type=int, default=8, help='doorknob sessions')
+    p.add_argument('--body', type=int, default=2048, help='body bytes')
+    p.add_argument('--timeout', type=float, default=300, help='seconds to wait for delivery')
+    p.add_argument('--bear', default=os.environ.get('BEARDIR'), help='BearSSL directory')
+    p.add_argument('--keep', action='store_true', help='keep the scratch directory')
+    args = p.parse_args()
+
+    tmp = tempfile.mkdtemp(prefix='doorknob-e2e-')
+    procs = []
+    try:
+        for d in ('spool', 'spool/queue', 'spool/tmp', 'spool/run'):
+            os.mkdir(os.path.join(tmp, d))
+        src = build(tmp, args)
+
+        port = free_port()
+        cert = key = None
+        sink_cmd = [sys.executable, os.path.join(BENCH, 'smtp-sink.py'),
+                    '--port', str(port), '--mode', args.mode,
+                    '--log', os.path.join(tmp, 'sink.log')]
+        if args.mode != 'plain':
+            cert, key = make_cert(tmp)
+            sink_cmd += ['--cert', cert, '--key', key]
+        sink = subprocess.Popen(sink_cmd)
+        procs.append(sink)
+        wait_port(port)
+
+        write_config(tmp, args, port, cert)
+        daemon = subprocess.Popen([os.path.join(src, 'doorknob'), '-C', '-f', '-s'],
+                                  stderr=open(os.path.join(tmp, 'doorknob.log'), 'w'))
+        procs.append(daemon)
+        time.sleep(0.2)
+        if daemon.poll() is not None:
+            args.keep = True
+            sys.exit('doorknob exited, see %s/doorknob.log' % tmp)
+
+        senders = Senders(os.path.join(src, 'sendmail'), args)
+        start = time.time()
+        senders.run()
+        enqueued = time.time()
+
+        sink_log = os.path.join(tmp, 'sink.log')
+        want = args.messages - senders.failed
+        while count_accepted(sink_log) < want and time.time() - start < args.timeout:
+            time.sleep(0.05)
+        delivered = time.time()
+
+        dk_cpu, dk_rss = proc_usage(daemon.pid)
+        sink_cpu, sink_rss = proc_usage(sink.pid)
+
+        lat, got = [], 0
+        for accepted, event, sent, _ in read_events(sink_log):
+            if event != 'accept':
+                continue
+            got += 1
+            if sent != '-':
+                lat.append((float(accepted) - float(sent)) * 1000)
+        lat.sort()
+
+        print('e2e mode=%s messages=%d concurrency=%d workers=%d body=%d '
+              'failed=%d delivered=%d' % (args.mode, args.messages, args.concurrency,
+                                          args.workers, args.body, senders.failed, got))
+        print('e2e enqueue_secs=%.3f enqueue/s=%.0f deliver_secs=%.3f deliver/s=%.0f' %
+              (enqueued - start, args.messages / (enqueued - start),
+               delivered - start, got / (delivered - start)))
+        print('e2e latency_ms p50=%.1f p90=%.1f p99=%.1f p999=%.1f max=%.1f' %
+              (percentile(lat, 0.5), percentile(lat, 0.9), percentile(lat, 0.99),
+               percentile(lat, 0.999), lat[-1] if lat else 0))
+        print('e2e proc=sendmail count=%d cpu_s=%.3f cpu_ms/msg=%.3f maxrss_kb=%d' %
+              (args.messages, senders.cpu, senders.cpu * 1000 / args.messages, senders.maxrss))
+        print('e2e proc=doorknob cpu_s=%.3f cpu_ms/msg=%.3f maxrss_kb=%d' %
+              (dk_cpu, dk_cpu * 1000 / max(got, 1), dk_rss))
+        print('e2e proc=sink cpu_s=%.3f maxrss_kb=%d' % (sink_cpu, sink_rss))
+        if got < want:
+            args.keep = True
+            sys.exit('only %d of %d delivered, see %s' % (got, want, tmp))
+    finally:
+        for proc in reversed(procs):
+            proc.send_signal(signal.SIGTERM)
+            try:
+                proc.wait(10)
+            except subprocess.TimeoutExpired:
+                proc.kill()
+        if args.keep:
+            print('kept', tmp, file=sys.stderr)
+        else:
+            shutil.rmtree(tmp, ignore_errors=True)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,176 @@
+/* enqueue.c - the header work sendmail -t does for a message
+ *
+ * Times look_for_to() over a synthetic message on stdin, and the
+ * header parser on its own, writing to /dev/null. A short header, a
+ * long body, a Cc list of a few hundred addresses, and one of a few
+ * thousand that is too big to hold and spills to a file.
+ *
+ * First it checks that a recipient list filling rcpts[] exactly comes
+ * out whole, build with -fsanitize=address to catch an overflow.
+ *
+ * Each line of output is one case as key=value pairs.
+ *
+ * usage: bench/enqueue [seconds]
+ */
+#define main sendmail_main
+#include "../sendmail.c"
+#undef main
+
+#include "bench.h"
+
+static double min_secs = 0.5;
+
+static char message[256 * 1024];
+
+/* A message as a cron job or a script would hand it to sendmail -t */
+static int make_message(int body_len, int ncc)
+{
+	int len, i;
+
+	len = snprintf(message, sizeof(message), BENCH_HEADER
+				   "To: Fred Flintstone <fred@example.com>, barney@example.com\n");
+	if (ncc) {
+		len += snprintf(message + len, sizeof(message) - len, "Cc: ");
+		for (i = 0; i < ncc; ++i)
+			len += snprintf(message + len, sizeof(message) - len,
+							"%suser%03d@example.com", i ? ", " : "", i);
+		message[len++] = '\n';
+	}
+	message[len++] = '\n';
+
+	if (body_len > sizeof(message) - 1 - len)
+		body_len = sizeof(message) - 1 - len;
+	bench_body(message + len, body_len);
+	len += body_len;
+	message[len] = 0;
+
+	return len;
+}
+
+/* The whole sendmail -t header pass, read() included */
+static void bench_look_for_to(const char *name, int body_len, int ncc, int out)
+{
+	long msgs = 0;
+	double secs;
+
+	int len = make_message(body_len, ncc);
+
+	FILE *fp = tmpfile();
+	if (!fp || fwrite(message, 1, len, fp) != len || fflush(fp)) {
+		perror("tmpfile");
+		exit(1);
+	}
+	dup2(fileno(fp), 0);
+
+	double start = now();
+	do {
+		lseek(0, 0, SEEK_SET);
+		look_for_to(out);
+		++msgs;
+	} while ((secs = now() - start) < min_secs);
+
+	bench_report("enqueue", name, len, msgs, secs);
+	fclose(fp);
+}
+
+/* The header parser without the read() */
+static void bench_header(const char *name, int ncc, int out)
+{
+	long msgs = 0;
+	double secs;
+
+	int len = make_message(0, ncc);
+
+	double start = now();
+	do {
+		struct header h = { .state = H_LINE };
+		hlen = rlen = 0;
+		if (header_feed(&h, message, len, out) < 0) {
+			fputs("header_feed: no end of header\n", stderr);
+			exit(1);
+		}
+		header_finish(&h, out);
+		++msgs;
+	} while ((secs = now() - start) < min_secs);
+
+	bench_report("enqueue", name, len, msgs, secs);
+}
+
+/* Recipients that fill rcpts[] to the last byte, 40 lines of 98 and
+ * 2 of 88 make 4096. The blank line that ends them must not overflow
+ * it and the list must come out whole.
+ */
+static void check_rcpts_full(void)
+{
+	char want[4096 + 1], got[sizeof(want)];
+	int len, wlen = 0, i;
+
+	len = snprintf(message, sizeof(message), "From: fred@example.com\nTo: ");
+	for (i = 0; i < 42; ++i) {
+		int n = i < 40 ? 97 : 87;
+		wlen += snprintf(want + wlen, sizeof(want) - wlen, "u%02d%0*d@example.com\n",
+						 i, n - 15, 0);
+		len += snprintf(message + len, sizeof(message) - len, "%s%.*s",
+						i ? ", " : "", n, want + wlen - n - 1);
+	}
+	len += snprintf(message + len, sizeof(message) - len, "\n\n");
+	want[wlen++] = '\n';
+	if (wlen != sizeof(want)) {
+		fprintf(stderr, "check_rcpts_full: %d bytes of recipients\n", wlen - 1);
+		exit(1);
+	}
+
+	FILE *fp = tmpfile();
+	if (!fp) {
+		perror("tmpfile");
+		exit(1);
+	}
+	struct header h = { .state = H_LINE };
+	hlen = rlen = 0;
+	if (header_feed(&h, message, len, fileno(fp)) < 0) {
+		fputs("header_feed: no end of header\n", stderr);
+		exit(1);
+	}
+	header_finish(&h, fileno(fp));
+
+	rewind(fp);
+	if (fread(got, 1, sizeof(got), fp) != sizeof(got) ||
+		memcmp(got, want, sizeof(want))) {
+		fputs("check_rcpts_full: recipients mangled\n", stderr);
+		exit(1);
+	}
+	fclose(fp);
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc > 1)
+		min_secs = strtod(argv[1], NULL);
+
+	int out = open("/dev/null", O_WRONLY);
+	if (out < 0) {
+		perror("/dev/null");
+		return 1;
+	}
+
+	// A big header spills to tmp/ in the spool, so fake one
+	char dir[] = "/tmp/enqueue.XXXXXX";
+	if (!mkdtemp(dir) || chdir(dir) || mkdir("tmp", 0700)) {
+		perror(dir);
+		return 1;
+	}
+
+	check_rcpts_full();
+
+	bench_look_for_to("look_for_to-2k", 2048, 0, out);
+	bench_look_for_to("look_for_to-32k", 32768, 0, out);
+	bench_look_for_to("look_for_to-cc300", 2048, 300, out);
+	bench_look_for_to("look_for_to-cc5000", 2048, 5000, out);
+	bench_header("header-short", 0, out);
+	bench_header("header-cc300", 300, out);
+
+	close(out);
+	rmdir("tmp");
+	rmdir(dir);
+	return 0;
+}
@@ -0,0 +1,162 @@
+#!/usr/bin/env python3
+"""faults.py - how doorknob drains its queue from a misbehaving server
+
+For each scenario it fills a scratch queue with sendmail, starts
+bench/smtp-sink.py with that scenario's faults, and runs doorknob
+until the sink has accepted every message. Retries are cut to retry-min 1 and
+retry-max 8 and the EHLO timeout to 2 seconds so a run takes
+seconds, not hours.
+
+For each scenario it prints one key=value line:
+    drain_secs     from starting doorknob to the last message accepted
+    conns          connections the sink saw
+    attempts/msg   MAIL FROMs per message accepted
+    deferred/msg   retries doorknob counted, per message accepted
+    bounced        messages doorknob gave up on
+    wasted_bytes   message data sent and then rejected or cut off
+
+The sink only ever answers 4xx, so every message must get through in
+the end. A scenario fails if one bounces or is still queued after
+--timeout, and the exit status is then 1.
+
+usage: bench/faults.py [--messages N] [--workers N] [--seed N]
+                       [scenario ...]
+"""
+import argparse
+import os
+import shutil
+import signal
+import subprocess
+import sys
+import tempfile
+import time
+
+import e2e
+
+SCENARIOS = {
+    'healthy':  [],
+    'slow':     ['--latency', '0.05'],
+    'throttle': ['--fail', '421:0.1'],
+    'flaky':    ['--fail', '451:0.2', '--drop-data', '0.05'],
+    'full':     ['--fail', '452:0.2'],
+    'stall':    ['--stall', '0.1'],
+    'quota':    ['--quota', '200'],
+}
+
+CONFIG = ['retry-min 1', 'retry-max 8', 'timeout-ehlo 2']
+
+
+def doorknob_metrics(doorknob):
+    r = subprocess.run([doorknob, '-m'], stdout=subprocess.PIPE, stderr=subprocess.DEVNULL)
+    metrics = {}
+    for line in r.stdout.decode(errors='replace').splitlines():
+        if line and not line.startswith('#'):
+            name, _, value = line.rpartition(' ')
+            metrics[name] = float(value)
+    return metrics
+
+
+def scenario(name, faults, top, args):
+    tmp = tempfile.mkdtemp(prefix='doorknob-faults-')
+    src, spool = os.path.join(top, 'src'), os.path.join(top, 'spool')
+    procs = []
+    try:
+        for d in ('queue', 'tmp'):
+            shutil.rmtree(os.path.join(spool, d), ignore_errors=True)
+            os.mkdir(os.path.join(spool, d))
+
+        # Fill the queue while nothing is delivering
+        senders = e2e.Senders(os.path.join(src, 'sendmail'), args)
+        senders.run()
+        want = args.messages - senders.failed
+
+        port = e2e.free_port()
+        sink_log = os.path.join(tmp, 'sink.log')
+        sink = subprocess.Popen([sys.executable, os.path.join(e2e.BENCH, 'smtp-sink.py'),
+                                 '--port', str(port), '--log', sink_log,
+                                 '--seed', str(args.seed)] + faults)
+        procs.append(sink)
+        e2e.wait_port(port)
+        # wait_port made a connection too
+        os.truncate(sink_log, 0)
+
+        e2e.write_config(top, args, port, None, CONFIG)
+        doorknob = os.path.join(src, 'doorknob')
+        start = time.time()
+        daemon = subprocess.Popen([doorknob, '-C', '-f', '-s'],
+                                  stderr=open(os.path.join(tmp, 'doorknob.log'), 'w'))
+        procs.append(daemon)
+
+        # A bounced message will never arrive, no point waiting for it
+        got = 0
+        while time.time() - start < args.timeout:
+            time.sleep(0.1)
+            got = e2e.count_accepted(sink_log)
+            if got >= want:
+                break
+            if doorknob_metrics(doorknob).get('doorknob_messages_bounced_total', 0):
+                break
+        drain = time.time() - start
+
+        metrics = doorknob_metrics(doorknob)
+        events = e2e.read_events(sink_log)
+        count = {}
+        wasted = 0
+        for _, event, _, size in events:
+            count[event] = count.get(event, 0) + 1
+            if event in ('reject', 'drop'):
+                wasted += int(size)
+
+        per = max(got, 1)
+        print('faults scenario=%-8s messages=%d delivered=%d drain_secs=%.2f conns=%d '
+              'attempts/msg=%.2f deferred/msg=%.2f bounced=%d wasted_bytes=%d' %
+              (name, want, got, drain, count.get('conn', 0),
+               count.get('mail', 0) / per,
+               metrics.get('doorknob_messages_deferred_total', 0) / per,
+               metrics.get('doorknob_messages_bounced_total', 0), wasted))
+        sys.stdout.flush()
+        if got < want:
+            print('faults scenario=%s: %d of %d messages not delivered' %
+                  (name, want - got, want), file=sys.stderr)
+            return False
+        return True
+    finally:
+        for proc in reversed(procs):
+            proc.send_signal(signal.SIGTERM)
+            try:
+                proc.wait(10)
+            except subprocess.TimeoutExpired:
+                proc.kill()
+        shutil.rmtree(tmp, ignore_errors=True)
+
+
+def main():
+    p = argparse.ArgumentParser(description='doorknob against a misbehaving server')
+    p.add_argument('scenarios', nargs='*', help='default all of: ' + ' '.join(SCENARIOS))
+    p.add_argument('--messages', type=int, default=300)
+    p.add_argument('--concurrency', type=int, default=50, help='sendmails at once')
+    p.add_argument('--workers', type=int, default=8, help='doorknob sessions')
+    p.add_argument('--body', type=int, default=4096, help='body bytes')
+    p.add_argument('--seed', type=int, default=1)
+    p.add_argument('--timeout', type=float, default=300, help='seconds to drain')
+    args = p.parse_args()
+    for name in args.scenarios:
+        if name not in SCENARIOS:
+            p.error('no scenario %s' % name)
+    args.mode, args.bear = 'plain', None
+
+    tmp = tempfile.mkdtemp(prefix='doorknob-faults-')
+    try:
+        os.mkdir(os.path.join(tmp, 'spool'))
+        os.mkdir(os.path.join(tmp, 'spool', 'run'))
+        e2e.build(tmp, args)
+        ok = True
+        for name in args.scenarios or SCENARIOS:
+            ok &= scenario(name, SCENARIOS[name], tmp, args)
+    finally:
+        shutil.rmtree(tmp, ignore_errors=True)
+    sys.exit(0 if ok else 1)
+
+
+if __name__ == '__main__':
+    main()
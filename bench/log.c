@@ -0,0 +1,113 @@
+/* log.c - cost of a log record, one write per call against batched
+ *
+ * Logs the same delivery line over and over to a file standing in
+ * for stderr. Once the way logmsg used to, formatted into a small
+ * buffer and written straight away, and then through log.c with a
+ * log_flush() every batch records, the way the poll loop flushes once
+ * a pass.
+ *
+ * usage: bench/log [file [records]]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "../log.c"
+#include "bench.h"
+
+/* The old logmsg */
+static void percall(const char *fmt, ...)
+{
+	va_list ap;
+	char msg[128];
+
+	va_start(ap, fmt);
+	vsnprintf(msg, sizeof(msg) - 1, fmt, ap);
+	va_end(ap);
+
+	strcat(msg, "\n");
+	if (write(2, msg, strlen(msg)) < 0)
+		exit(1);
+}
+
+static void report(const char *mode, int batch, int records, double secs, double cpus)
+{
+	printf("log mode=%-7s batch=%-4d records=%d secs=%.3f ns/record=%.0f cpu_ns/record=%.0f\n",
+		   mode, batch, records, secs, secs * 1e9 / records, cpus * 1e9 / records);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *file = argc > 1 ? argv[1] : "/tmp/doorknob-log-bench";
+	int records = argc > 2 ? strtol(argv[2], NULL, 0) : 200000;
+	static const int batches[] = { 1, 16, 256 };
+	int i, b;
+
+	int fd = open(file, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+	if (fd < 0) {
+		perror(file);
+		return 1;
+	}
+	int saved = dup(2);
+	dup2(fd, 2);
+
+	double start = now(), cpu_start = cpu();
+	for (i = 0; i < records; ++i)
+		percall("%s: sent to %s as %d.%06d.%d", "fred@example.com", "smtp.example.com",
+				1500000000 + i, i % 1000000, 1234);
+	double secs = now() - start, cpus = cpu() - cpu_start;
+
+	dup2(saved, 2);
+	report("percall", 1, records, secs, cpus);
+
+	log_to_stderr();
+	for (b = 0; b < 3; ++b) {
+		int batch = batches[b];
+
+		if (ftruncate(fd, 0))
+			return 1;
+		dup2(fd, 2);
+
+		start = now();
+		cpu_start = cpu();
+		for (i = 0; i < records; ++i) {
+			logmsg("%s: sent to %s as %d.%06d.%d", "fred@example.com", "smtp.example.com",
+				   1500000000 + i, i % 1000000, 1234);
+			if ((i + 1) % batch == 0)
+				log_flush();
+		}
+		log_flush();
+		secs = now() - start;
+		cpus = cpu() - cpu_start;
+
+		dup2(saved, 2);
+		report("batched", batch, records, secs, cpus);
+	}
+
+	// The key=value records cost a copy and a clock read more
+	log_set_format(LOG_KV);
+	if (ftruncate(fd, 0))
+		return 1;
+	dup2(fd, 2);
+	start = now();
+	cpu_start = cpu();
+	for (i = 0; i < records; ++i) {
+		logmsg("%s: sent to %s as %d.%06d.%d", "fred@example.com", "smtp.example.com",
+			   1500000000 + i, i % 1000000, 1234);
+		if ((i + 1) % 256 == 0)
+			log_flush();
+	}
+	log_flush();
+	secs = now() - start;
+	cpus = cpu() - cpu_start;
+	dup2(saved, 2);
+	report("kv", 256, records, secs, cpus);
+
+	close(fd);
+	unlink(file);
+	return 0;
+}
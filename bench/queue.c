@@ -0,0 +1,221 @@
+/* queue.c - enqueue and scan cost of the flat and hashed queues
+ *
+ * For each queue size it fills a queue, then times sendmail style
+ * enqueues (write to tmp/ and rename into the queue), a full scan as
+ * done by doorknob at startup and mailq, and unlinks as done after
+ * delivery. Run it on the filesystem the spool lives on, tmpfs will
+ * not show the directory size effects.
+ *
+ * The queues go in a scratch directory under dir, /tmp by default,
+ * which is removed at the end or on an interrupt. The default counts
+ * are small enough for make bench; ask for 1000000 to see the flat
+ * queue fall over.
+ *
+ * usage: bench/queue [dir [count ...]]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <signal.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "../doorknob.h"
+#include "bench.h"
+
+#define SAMPLE 1000
+
+static char top[PATH_MAX]; // the scratch directory
+static volatile sig_atomic_t stop;
+
+static void remove_dir(const char *dname)
+{
+	char path[PATH_MAX];
+	struct dirent *ent;
+
+	DIR *dir = opendir(dname);
+	if (!dir)
+		return;
+	while ((ent = readdir(dir))) {
+		if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", dname, ent->d_name);
+		if (unlink(path))
+			remove_dir(path);
+	}
+	closedir(dir);
+	rmdir(dname);
+}
+
+static void cleanup(void)
+{
+	if (*top)
+		remove_dir(top);
+}
+
+static void on_signal(int sig)
+{
+	stop = 1;
+}
+
+static void name_of(char *name, int len, int n)
+{
+	snprintf(name, len, "%d.%06d.%d", 1500000000 + n / 1000, n % 1000, 1234);
+}
+
+static void enqueue(int n, int hashed)
+{
+	static const char body[] = "fred@example.com\n\nSubject: bench\n\nhello\n";
+	char name[40], tmp[48], path[64], qpath[48];
+
+	name_of(name, sizeof(name), n);
+	snprintf(tmp, sizeof(tmp), "tmp/%s", name);
+	queue_path(qpath, sizeof(qpath), name, hashed);
+	snprintf(path, sizeof(path), "queue/%s", qpath);
+
+	if (stop)
+		exit(1);
+
+	int fd = creat(tmp, 0666);
+	if (fd < 0 || write(fd, body, sizeof(body) - 1) < 0 || close(fd) ||
+		rename(tmp, path)) {
+		perror(path);
+		exit(1);
+	}
+}
+
+static void dequeue(int n, int hashed)
+{
+	char name[40], path[64], qpath[48];
+
+	name_of(name, sizeof(name), n);
+	queue_path(qpath, sizeof(qpath), name, hashed);
+	snprintf(path, sizeof(path), "queue/%s", qpath);
+	if (unlink(path)) {
+		perror(path);
+		exit(1);
+	}
+}
+
+static int scan_dir(const char *dname)
+{
+	struct dirent *ent;
+	int count = 0;
+
+	DIR *dir = opendir(dname);
+	if (!dir) {
+		perror(dname);
+		exit(1);
+	}
+	while ((ent = readdir(dir)))
+		if (*ent->d_name != '.')
+			++count;
+	closedir(dir);
+	return count;
+}
+
+static int scan(int hashed)
+{
+	char dname[16];
+	int count = 0;
+
+	if (!hashed)
+		return scan_dir("queue");
+
+	for (int i = 0; i < QUEUE_DIRS; ++i) {
+		snprintf(dname, sizeof(dname), "queue/%02x", i);
+		count += scan_dir(dname);
+	}
+	return count;
+}
+
+static void run(int count, int hashed)
+{
+	char dname[16];
+	double start;
+	int i;
+
+	if (mkdir("queue", 0777) || mkdir("tmp", 0777)) {
+		perror("mkdir");
+		exit(1);
+	}
+	if (hashed)
+		for (i = 0; i < QUEUE_DIRS; ++i) {
+			snprintf(dname, sizeof(dname), "queue/%02x", i);
+			mkdir(dname, 0777);
+		}
+
+	start = now();
+	for (i = 0; i < count; ++i)
+		enqueue(i, hashed);
+	double fill = now() - start;
+
+	// drop the page cache effects of the fill as much as we can
+	sync();
+
+	start = now();
+	for (i = count; i < count + SAMPLE; ++i)
+		enqueue(i, hashed);
+	double enq = now() - start;
+
+	start = now();
+	int found = scan(hashed);
+	double scanned = now() - start;
+	if (found != count + SAMPLE) {
+		fprintf(stderr, "scan found %d of %d\n", found, count + SAMPLE);
+		exit(1);
+	}
+
+	start = now();
+	for (i = count; i < count + SAMPLE; ++i)
+		dequeue(i, hashed);
+	double deq = now() - start;
+
+	printf("queue layout=%s entries=%d fill_us=%.2f enqueue_us=%.2f "
+		   "scan_ms=%.2f scan_ns_per_entry=%.1f unlink_us=%.2f\n",
+		   hashed ? "hashed" : "flat", count,
+		   fill * 1e6 / count, enq * 1e6 / SAMPLE,
+		   scanned * 1e3, scanned * 1e9 / found, deq * 1e6 / SAMPLE);
+	fflush(stdout);
+
+	for (i = 0; i < count; ++i)
+		dequeue(i, hashed);
+	if (hashed)
+		for (i = 0; i < QUEUE_DIRS; ++i) {
+			snprintf(dname, sizeof(dname), "queue/%02x", i);
+			rmdir(dname);
+		}
+	rmdir("queue");
+	rmdir("tmp");
+}
+
+int main(int argc, char *argv[])
+{
+	int counts[] = { 1000, 10000 };
+	char dname[] = "bench-queue.XXXXXX";
+	const char *where = argc > 1 ? argv[1] : "/tmp";
+
+	if (chdir(where) || !mkdtemp(dname) || chdir(dname) ||
+		!getcwd(top, sizeof(top))) {
+		perror(where);
+		exit(1);
+	}
+	atexit(cleanup);
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	if (argc > 2)
+		for (int i = 2; i < argc; ++i)
+			for (int hashed = 0; hashed < 2; ++hashed)
+				run(strtol(argv[i], NULL, 0), hashed);
+	else
+		for (int i = 0; i < 2; ++i)
+			for (int hashed = 0; hashed < 2; ++hashed)
+				run(counts[i], hashed);
+
+	return 0; // cleanup() removes the scratch directory
+}
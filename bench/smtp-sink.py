@@ -0,0 +1,209 @@
+#!/usr/bin/env python3
+"""smtp-sink.py - an SMTP server that accepts and throws away mail
+
+For load testing doorknob without a real mail server. It speaks
+plain SMTP, STARTTLS or smtps and says yes to everything (AUTH
+included), unless told to misbehave. It appends a line per event to
+the log:
+
+    <epoch secs> <event> <sent epoch secs or -> <bytes or ->
+
+The events are conn (a connection), mail (a MAIL FROM), accept
+(a 250 for the message), reject (a 451 after the data) and drop (the
+connection was closed in the middle of the data). sent comes from an
+X-Bench-Sent header if the message has one.
+
+Faults, each picked at random at the given rate, 0 to 1:
+    --latency SECS    delay every reply
+    --fail CODE:RATE  421 a MAIL and hang up, 452 a RCPT or 451 the
+                      final dot; may be given more than once
+    --drop-data RATE  hang up after the first 1k of the data
+    --stall RATE      send the greeting, then never answer
+    --quota N         450 every MAIL past N accepted this minute
+
+usage: smtp-sink.py [--port N] [--mode plain|starttls|smtps]
+                    [--cert pem --key pem] [--log file] [--seed N]
+                    [faults]
+
+Needs Python 3.11 or later.
+"""
+import argparse
+import asyncio
+import random
+import ssl
+import sys
+import time
+
+DROP_AFTER = 1024
+
+
+class Sink:
+    def __init__(self, args):
+        self.args = args
+        self.tls = None
+        if args.mode != 'plain':
+            self.tls = ssl.create_default_context(ssl.Purpose.CLIENT_AUTH)
+            self.tls.load_cert_chain(args.cert, args.key)
+        self.log = open(args.log, 'a', buffering=1) if args.log else sys.stdout
+        self.random = random.Random(args.seed)
+        self.fail = {}
+        for f in args.fail:
+            code, _, rate = f.partition(':')
+            self.fail[int(code)] = float(rate)
+        self.minute = 0
+        self.this_minute = 0
+
+    def event(self, what, sent='-', size='-'):
+        self.log.write('%.6f %s %s %s\n' % (time.time(), what, sent, size))
+
+    def roll(self, rate):
+        return rate > 0 and self.random.random() < rate
+
+    def over_quota(self):
+        if not self.args.quota:
+            return False
+        minute = int(time.time() // 60)
+        if minute != self.minute:
+            self.minute, self.this_minute = minute, 0
+        return self.this_minute >= self.args.quota
+
+    def ehlo(self, tls_active):
+        caps = ['sink', 'PIPELINING', '8BITMIME', 'AUTH PLAIN LOGIN']
+        if self.args.mode == 'starttls' and not tls_active:
+            caps.append('STARTTLS')
+        return ''.join('250-%s\r\n' % c for c in caps[:-1]) + '250 %s\r\n' % caps[-1]
+
+    async def data(self, reader, drop):
+        """Returns the size and sent time, or None for the size if dropped"""
+        size, sent = 0, '-'
+        in_header = True
+        while True:
+            line = await reader.readline()
+            if not line or line in (b'.\r\n', b'.\n'):
+                return size, sent
+            size += len(line)
+            if in_header:
+                if line in (b'\r\n', b'\n'):
+                    in_header = False
+                elif line[:14].lower() == b'x-bench-sent: ':
+                    sent = line[14:].strip().decode(errors='replace')
+            if drop and size >= DROP_AFTER:
+                self.event('drop', sent, size)
+                return None, sent
+
+    async def session(self, reader, writer):
+        tls_active = self.args.mode == 'smtps'
+        self.event('conn')
+
+        async def out(s):
+            if self.args.latency:
+                await asyncio.sleep(self.args.latency)
+            writer.write(s.encode())
+            await writer.drain()
+
+        rcpts = 0
+        try:
+            await out('220 sink ESMTP\r\n')
+            if self.roll(self.args.stall):
+                while await reader.read(4096):
+                    pass
+                writer.close()
+                return
+            while True:
+                line = await reader.readline()
+                if not line:
+                    break
+                cmd = line.decode(errors='replace').strip().upper()
+                if cmd.startswith(('EHLO', 'HELO')):
+                    await out(self.ehlo(tls_active))
+                elif cmd == 'STARTTLS' and self.tls and not tls_active:
+                    await out('220 go ahead\r\n')
+                    await writer.start_tls(self.tls)
+                    tls_active = True
+                elif cmd.startswith('AUTH'):
+                    await out('235 ok\r\n')
+                elif cmd.startswith('MAIL'):
+                    self.event('mail')
+                    rcpts = 0
+                    if self.roll(self.fail.get(421, 0)):
+                        await out('421 4.3.2 try again later\r\n')
+                        break
+                    if self.over_quota():
+                        await out('450 4.2.1 quota exceeded\r\n')
+                    else:
+                        await out('250 ok\r\n')
+                elif cmd.startswith('RCPT'):
+                    if self.roll(self.fail.get(452, 0)):
+                        await out('452 4.2.2 mailbox full\r\n')
+                    else:
+                        rcpts += 1
+                        await out('250 ok\r\n')
+                elif cmd.startswith(('RSET', 'NOOP')):
+                    rcpts = 0
+                    await out('250 ok\r\n')
+                elif cmd == 'DATA' and rcpts == 0:
+                    await out('554 5.5.1 no valid recipients\r\n')
+                elif cmd == 'DATA':
+                    await out('354 go\r\n')
+                    size, sent = await self.data(reader, self.roll(self.args.drop_data))
+                    if size is None:
+                        break
+                    if self.roll(self.fail.get(451, 0)):
+                        self.event('reject', sent, size)
+                        await out('451 4.3.0 try again\r\n')
+                    else:
+                        self.this_minute += 1
+                        self.event('accept', sent, size)
+                        await out('250 queued\r\n')
+                elif cmd == 'QUIT':
+                    await out('221 bye\r\n')
+                    break
+                else:
+                    await out('500 what\r\n')
+        except (ConnectionError, ssl.SSLError, asyncio.IncompleteReadError):
+            pass
+        writer.close()
+
+    async def run(self):
+        tls = self.tls if self.args.mode == 'smtps' else None
+        servers = []
+        for host in ('127.0.0.1', '::1'):
+            try:
+                servers.append(await asyncio.start_server(
+                    self.session, host, self.args.port, ssl=tls,
+                    reuse_address=True, backlog=1024))
+            except OSError:
+                if host == '127.0.0.1':
+                    raise  # ::1 is optional
+        await asyncio.gather(*(s.serve_forever() for s in servers))
+
+
+def main():
+    p = argparse.ArgumentParser(description='SMTP server that accepts and discards mail')
+    p.add_argument('--port', type=int, default=2525)
+    p.add_argument('--mode', choices=('plain', 'starttls', 'smtps'), default='plain')
+    p.add_argument('--cert', help='PEM certificate for starttls and smtps')
+    p.add_argument('--key', help='PEM key for starttls and smtps')
+    p.add_argument('--log', help='append events here rather than stdout')
+    p.add_argument('--seed', type=int, help='for repeatable faults')
+    p.add_argument('--latency', type=float, default=0, help='seconds before each reply')
+    p.add_argument('--fail', action='append', default=[], metavar='CODE:RATE',
+                   help='421 at MAIL, 452 at RCPT or 451 at the final dot')
+    p.add_argument('--drop-data', type=float, default=0, metavar='RATE')
+    p.add_argument('--stall', type=float, default=0, metavar='RATE')
+    p.add_argument('--quota', type=int, default=0, help='messages a minute')
+    args = p.parse_args()
+    if args.mode != 'plain' and not (args.cert and args.key):
+        p.error('%s needs --cert and --key' % args.mode)
+    for f in args.fail:
+        if f.partition(':')[0] not in ('421', '451', '452'):
+            p.error('--fail takes 421, 451 or 452')
+
+    try:
+        asyncio.run(Sink(args).run())
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == '__main__':
+    main()
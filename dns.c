@@ -0,0 +1,565 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "doorknob.h"
+
+/* A small stub resolver so looking up the smtp server never blocks
+ * the poll loop. It asks the nameservers in resolv.conf for the A and
+ * AAAA records over UDP and keeps every address. The lookup is redone
+ * in the background when the TTL runs out, and the old addresses are
+ * used until the new ones arrive. IP literals and names in the hosts
+ * file never expire. Short names go through the search list the way
+ * the C library does it.
+ *
+ * Each address has a failure score and a smoothed connect time. The
+ * addresses are kept sorted by score, then by connect time, with the
+ * ones we have no time for last. dns_addr() hands them out
+ * alternating between IPv6 and IPv4 as RFC 8305 suggests, so a broken
+ * family only costs one connection attempt delay.
+ */
+
+#ifndef RESOLV_CONF
+#define RESOLV_CONF "/etc/resolv.conf"
+#endif
+#ifndef HOSTS_FILE
+#define HOSTS_FILE "/etc/hosts"
+#endif
+
+#define MAX_NS      3
+#define MAX_SEARCH  6
+#define MAX_ADDRS   16
+#define DNS_TIMEOUT 2000     // ms per try
+#define DNS_TRIES   2        // per nameserver
+#define MIN_TTL     30       // seconds
+#define MAX_TTL     86400
+#define NEVER       0x7fffffffffffffffLL
+
+#define T_A    1
+#define T_AAAA 28
+
+struct dns_addr {
+	struct sockaddr_storage sa;
+	socklen_t len;
+	int score;
+	int rtt;                // ms, 0 if we have never connected
+};
+
+struct dns_host {
+	char name[256];
+	int port;
+	int naddrs;
+	struct dns_addr addrs[MAX_ADDRS];
+	int order[MAX_ADDRS];   // interleaved by family
+	long long expires;      // when to look it up again
+	int failed;             // last lookup failed, already logged
+
+	/* The lookup in progress */
+	char qname[256];        // name with a search domain, if any
+	int cand;               // which of the names to try we are on
+	int sock;
+	int tries;
+	long long deadline;
+	unsigned short id[2];   // A and AAAA
+	int pending;            // bit per outstanding query
+	int nfresh;
+	struct dns_addr fresh[MAX_ADDRS];
+	unsigned ttl;
+};
+
+static struct sockaddr_storage ns[MAX_NS];
+static socklen_t ns_len[MAX_NS];
+static int nns = -1;
+
+static char search[MAX_SEARCH][256];
+static int nsearch, ndots = 1;
+
+static int set_addr(struct sockaddr_storage *ss, socklen_t *len, const char *str, int port)
+{
+	struct sockaddr_in *sin = (struct sockaddr_in *)ss;
+	struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)ss;
+
+	memset(ss, 0, sizeof(*ss));
+	if (inet_pton(AF_INET, str, &sin->sin_addr) == 1) {
+		sin->sin_family = AF_INET;
+		sin->sin_port = htons(port);
+		*len = sizeof(*sin);
+		return 0;
+	}
+	if (inet_pton(AF_INET6, str, &sin6->sin6_addr) == 1) {
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_port = htons(port);
+		*len = sizeof(*sin6);
+		return 0;
+	}
+	return -1;
+}
+
+static void read_resolv_conf(void)
+{
+	char line[256];
+
+	nns = 0;
+
+	FILE *fp = fopen(RESOLV_CONF, "r");
+	if (fp) {
+		while (fgets(line, sizeof(line), fp)) {
+			char *key = strtok(line, " \t\r\n");
+			char *val = strtok(NULL, " \t\r\n");
+			if (!key || !val)
+				continue;
+			if (strcmp(key, "nameserver") == 0) {
+				if (nns < MAX_NS && set_addr(&ns[nns], &ns_len[nns], val, 53) == 0)
+					++nns;
+			} else if (strcmp(key, "domain") == 0 || strcmp(key, "search") == 0) {
+				// The last one wins
+				for (nsearch = 0; val && nsearch < MAX_SEARCH; val = strtok(NULL, " \t\r\n"))
+					strlcpy(search[nsearch++], val, sizeof(search[0]));
+			} else if (strcmp(key, "options") == 0) {
+				for (; val; val = strtok(NULL, " \t\r\n"))
+					if (strncmp(val, "ndots:", 6) == 0)
+						ndots = strtol(val + 6, NULL, 10);
+			}
+		}
+		fclose(fp);
+	}
+
+	if (nsearch == 0) {
+		// Default to our own domain
+		char host[HOST_NAME_MAX + 1], *dot;
+		if (gethostname(host, sizeof(host)) == 0 && (dot = strchr(host, '.')) && dot[1])
+			strlcpy(search[nsearch++], dot + 1, sizeof(search[0]));
+	}
+
+	if (nns == 0) {
+		// Same default as the C library
+		set_addr(&ns[0], &ns_len[0], "127.0.0.1", 53);
+		nns = 1;
+	}
+}
+
+static void add_addr(struct dns_addr *addrs, int *n, const char *str, int port)
+{
+	if (*n < MAX_ADDRS && set_addr(&addrs[*n].sa, &addrs[*n].len, str, port) == 0) {
+		addrs[*n].score = 0;
+		addrs[*n].rtt = 0;
+		++*n;
+	}
+}
+
+static int read_hosts(struct dns_host *h)
+{
+	char line[512], *p;
+
+	FILE *fp = fopen(HOSTS_FILE, "r");
+	if (!fp)
+		return 0;
+
+	while (fgets(line, sizeof(line), fp)) {
+		if ((p = strchr(line, '#')))
+			*p = 0;
+		char *addr = strtok(line, " \t\r\n");
+		while (addr && (p = strtok(NULL, " \t\r\n")))
+			if (strcasecmp(p, h->name) == 0) {
+				add_addr(h->addrs, &h->naddrs, addr, h->port);
+				break;
+			}
+	}
+
+	fclose(fp);
+	return h->naddrs;
+}
+
+static int same_addr(const struct dns_addr *a, const struct sockaddr *sa)
+{
+	const struct sockaddr_in *sin = (const struct sockaddr_in *)sa;
+	const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)sa;
+
+	if (a->sa.ss_family != sa->sa_family)
+		return 0;
+	if (sa->sa_family == AF_INET)
+		return memcmp(&((struct sockaddr_in *)&a->sa)->sin_addr,
+					  &sin->sin_addr, sizeof(sin->sin_addr)) == 0;
+	return memcmp(&((struct sockaddr_in6 *)&a->sa)->sin6_addr,
+				  &sin6->sin6_addr, sizeof(sin6->sin6_addr)) == 0;
+}
+
+static int worse(const struct dns_addr *a, const struct dns_addr *b)
+{
+	if (a->score != b->score)
+		return a->score > b->score;
+	if (a->rtt == 0 || b->rtt == 0)
+		return a->rtt == 0 && b->rtt != 0;
+	return a->rtt > b->rtt;
+}
+
+/* Keep the addresses in preference order. Stable so the DNS order is
+ * kept between equals. Then interleave the families starting with the
+ * family of the best address.
+ */
+static void sort_addrs(struct dns_host *h)
+{
+	int i, j, n[2] = { 0, 0 };
+
+	for (i = 1; i < h->naddrs; ++i) {
+		struct dns_addr a = h->addrs[i];
+		for (j = i; j > 0 && worse(&h->addrs[j - 1], &a); --j)
+			h->addrs[j] = h->addrs[j - 1];
+		h->addrs[j] = a;
+	}
+
+	if (h->naddrs == 0)
+		return;
+
+	int family = h->addrs[0].sa.ss_family;
+	for (i = 0; i < h->naddrs; ++i) {
+		// Take the next of the wanted family if there is one left
+		int want = i & 1;
+		for (j = n[want]; j < h->naddrs; ++j)
+			if ((h->addrs[j].sa.ss_family == family) == !want)
+				break;
+		if (j == h->naddrs) {
+			want = !want;
+			for (j = n[want]; j < h->naddrs; ++j)
+				if ((h->addrs[j].sa.ss_family == family) == !want)
+					break;
+		}
+		h->order[i] = j;
+		n[want] = j + 1;
+	}
+}
+
+/* The nth name to try for h. A name with ndots dots is tried as is
+ * first, a shorter one after the search domains. A trailing dot means
+ * no search. Returns -1 when there are no more.
+ */
+static int candidate(struct dns_host *h, int n)
+{
+	const char *p, *name = h->name;
+	int dots = 0, len = strlen(name);
+
+	for (p = name; *p; ++p)
+		if (*p == '.')
+			++dots;
+
+	if (len && name[len - 1] == '.') {
+		if (n)
+			return -1;
+		strlcpy(h->qname, name, sizeof(h->qname));
+		h->qname[len - 1] = 0;
+		return 0;
+	}
+
+	if (dots >= ndots) {
+		if (n == 0) {
+			strlcpy(h->qname, name, sizeof(h->qname));
+			return 0;
+		}
+		--n;
+	} else if (n == nsearch) {
+		strlcpy(h->qname, name, sizeof(h->qname));
+		return 0;
+	}
+
+	if (n >= nsearch)
+		return -1;
+	strconcat(h->qname, sizeof(h->qname), name, ".", search[n], NULL);
+	return 0;
+}
+
+static int send_query(struct dns_host *h, int which)
+{
+	unsigned char buf[512], *p = buf;
+	const char *name = h->qname;
+
+	*p++ = h->id[which] >> 8;
+	*p++ = h->id[which];
+	*p++ = 1; // RD
+	*p++ = 0;
+	*p++ = 0; *p++ = 1; // one question
+	memset(p, 0, 6);
+	p += 6;
+
+	while (*name) {
+		const char *dot = strchr(name, '.');
+		int len = dot ? dot - name : strlen(name);
+		if (len == 0 || len > 63)
+			return -1;
+		*p++ = len;
+		memcpy(p, name, len);
+		p += len;
+		name += len;
+		if (*name)
+			++name;
+	}
+	*p++ = 0;
+
+	unsigned short type = which ? T_AAAA : T_A;
+	*p++ = type >> 8;
+	*p++ = type;
+	*p++ = 0; *p++ = 1; // IN
+
+	return send(h->sock, buf, p - buf, 0) < 0 ? -1 : 0;
+}
+
+/* Send the queries still outstanding to the next nameserver */
+static void query(struct dns_host *h, long long now)
+{
+	if (h->sock >= 0)
+		close(h->sock);
+
+	int n = (h->tries / DNS_TRIES) % nns;
+	h->sock = socket(ns[n].ss_family, SOCK_DGRAM, 0);
+	if (h->sock < 0) {
+		logmsg("socket: %s", strerror(errno));
+		h->deadline = now + DNS_TIMEOUT;
+		return;
+	}
+	fcntl(h->sock, F_SETFL, O_NONBLOCK);
+
+	// Connected so the kernel drops replies from anybody else
+	if (connect(h->sock, (struct sockaddr *)&ns[n], ns_len[n]) ||
+		((h->pending & 1) && send_query(h, 0)) ||
+		((h->pending & 2) && send_query(h, 1)))
+		logmsg("dns %s: %s", h->qname, strerror(errno));
+
+	h->deadline = now + DNS_TIMEOUT;
+}
+
+/* Look up the current candidate name */
+static void lookup_name(struct dns_host *h, long long now)
+{
+	h->tries = 0;
+	h->pending = 3;
+	h->nfresh = 0;
+	h->ttl = MAX_TTL;
+	h->id[0] = random();
+	h->id[1] = h->id[0] + 1;
+	query(h, now);
+}
+
+static void lookup(struct dns_host *h, long long now)
+{
+	h->cand = 0;
+	candidate(h, 0);
+	lookup_name(h, now);
+}
+
+static void lookup_done(struct dns_host *h, long long now)
+{
+	close(h->sock);
+	h->sock = -1;
+	h->pending = 0;
+
+	if (h->nfresh == 0 && candidate(h, h->cand + 1) == 0) {
+		++h->cand;
+		lookup_name(h, now);
+		return;
+	}
+
+	if (h->nfresh == 0) {
+		// Keep using what we have and try again soon
+		if (!h->failed)
+			logmsg("Warning: Unable to get host %s", h->name);
+		h->failed = 1;
+		h->expires = now + MIN_TTL * 1000;
+		return;
+	}
+
+	// IPv6 first (RFC 6724), then addresses we already knew keep
+	// their history
+	struct dns_addr old[MAX_ADDRS];
+	int nold = h->naddrs;
+	memcpy(old, h->addrs, nold * sizeof(struct dns_addr));
+
+	h->naddrs = 0;
+	for (int v6 = 1; v6 >= 0; --v6)
+		for (int i = 0; i < h->nfresh; ++i) {
+			struct dns_addr *a = &h->fresh[i];
+			if ((a->sa.ss_family == AF_INET6) != v6)
+				continue;
+			for (int j = 0; j < nold; ++j)
+				if (same_addr(&old[j], (struct sockaddr *)&a->sa)) {
+					a->score = old[j].score;
+					a->rtt = old[j].rtt;
+					break;
+				}
+			h->addrs[h->naddrs++] = *a;
+		}
+	sort_addrs(h);
+
+	if (h->ttl < MIN_TTL)
+		h->ttl = MIN_TTL;
+	h->expires = now + h->ttl * 1000LL;
+	h->failed = 0;
+}
+
+static int skip_name(const unsigned char *buf, int len, int off)
+{
+	while (off < len) {
+		if (buf[off] == 0)
+			return off + 1;
+		if ((buf[off] & 0xc0) == 0xc0)
+			return off + 2;
+		off += buf[off] + 1;
+	}
+	return -1;
+}
+
+static void parse_reply(struct dns_host *h, const unsigned char *buf, int len)
+{
+	char str[INET6_ADDRSTRLEN];
+	int which, i, off;
+
+	if (len < 12 || !(buf[2] & 0x80))
+		return;
+
+	unsigned short id = (buf[0] << 8) | buf[1];
+	for (which = 0; which < 2; ++which)
+		if (id == h->id[which] && (h->pending & (1 << which)))
+			break;
+	if (which == 2)
+		return; // stale or bogus
+
+	h->pending &= ~(1 << which);
+
+	int rcode = buf[3] & 0xf;
+	if (rcode)
+		return; // NXDOMAIN and friends, the other query may still work
+
+	int qd = (buf[4] << 8) | buf[5];
+	int an = (buf[6] << 8) | buf[7];
+	off = 12;
+	for (i = 0; i < qd && off > 0; ++i)
+		if ((off = skip_name(buf, len, off)) > 0)
+			off += 4;
+
+	unsigned short want = which ? T_AAAA : T_A;
+	for (i = 0; i < an && off > 0 && off + 10 <= len; ++i) {
+		off = skip_name(buf, len, off);
+		if (off < 0 || off + 10 > len)
+			break;
+		unsigned short type = (buf[off] << 8) | buf[off + 1];
+		unsigned short class = (buf[off + 2] << 8) | buf[off + 3];
+		unsigned ttl = ((unsigned)buf[off + 4] << 24) | (buf[off + 5] << 16) |
+			(buf[off + 6] << 8) | buf[off + 7];
+		int rdlen = (buf[off + 8] << 8) | buf[off + 9];
+		off += 10;
+		if (off + rdlen > len)
+			break;
+
+		// CNAMEs are followed by the server, just take the addresses
+		if (class == 1 && type == want && rdlen == (which ? 16 : 4) &&
+			inet_ntop(which ? AF_INET6 : AF_INET, buf + off, str, sizeof(str))) {
+			add_addr(h->fresh, &h->nfresh, str, h->port);
+			if (ttl < h->ttl)
+				h->ttl = ttl;
+		}
+		off += rdlen;
+	}
+}
+
+/* Starts the lookup, an IP literal or a name in the hosts file is
+ * ready right away.
+ */
+struct dns_host *dns_open(const char *name, int port, long long now)
+{
+	struct dns_host *h = calloc(1, sizeof(struct dns_host));
+	if (!h) {
+		logmsg("Out of memory!");
+		exit(1);
+	}
+
+	if (nns < 0)
+		read_resolv_conf();
+
+	strlcpy(h->name, name, sizeof(h->name));
+	h->port = port;
+	h->sock = -1;
+
+	add_addr(h->addrs, &h->naddrs, name, port);
+	if (h->naddrs || read_hosts(h)) {
+		sort_addrs(h);
+		h->expires = NEVER;
+		return h;
+	}
+
+	lookup(h, now);
+	return h;
+}
+
+/* The socket to poll for replies, -1 if no lookup is running */
+int dns_fd(struct dns_host *h)
+{
+	return h->sock;
+}
+
+/* When dns_step() needs to be called even if nothing arrives */
+long long dns_deadline(struct dns_host *h)
+{
+	return h->sock >= 0 ? h->deadline : h->expires;
+}
+
+void dns_step(struct dns_host *h, long long now)
+{
+	unsigned char buf[1500];
+	int n;
+
+	if (h->sock < 0) {
+		if (now >= h->expires)
+			lookup(h, now);
+		return;
+	}
+
+	while ((n = recv(h->sock, buf, sizeof(buf), 0)) > 0)
+		parse_reply(h, buf, n);
+
+	if (h->pending == 0)
+		lookup_done(h, now);
+	else if (now >= h->deadline) {
+		if (++h->tries < nns * DNS_TRIES)
+			query(h, now);
+		else
+			lookup_done(h, now);
+	}
+}
+
+/* Number of addresses we can try */
+int dns_count(struct dns_host *h)
+{
+	return h->naddrs;
+}
+
+/* The nth address to try */
+const struct sockaddr *dns_addr(struct dns_host *h, int n, unsigned *len)
+{
+	struct dns_addr *a = &h->addrs[h->order[n]];
+
+	*len = a->len;
+	return (struct sockaddr *)&a->sa;
+}
+
+/* Connecting to the address worked, in ms, or not (ms < 0) */
+void dns_report(struct dns_host *h, const struct sockaddr *sa, int ms)
+{
+	for (int i = 0; i < h->naddrs; ++i)
+		if (same_addr(&h->addrs[i], sa)) {
+			struct dns_addr *a = &h->addrs[i];
+			if (ms >= 0) {
+				a->score = 0;
+				if (ms == 0)
+					ms = 1; // 0 means unknown
+				// 1/8 weight like the TCP srtt
+				a->rtt = a->rtt ? (7 * a->rtt + ms) / 8 : ms;
+			} else if (a->score < 1000)
+				++a->score;
+			sort_addrs(h);
+			return;
+		}
+}
@@ -19,116 +19,469 @@
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <stdarg.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <ctype.h>
 #include <errno.h>
-#include <dirent.h>
 #include <poll.h>
-#include <syslog.h>
 #include <pwd.h>
+#include <signal.h>
+#include <time.h>
 #include <sys/stat.h>
 #include <sys/inotify.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
-#include <netdb.h>
 
 #include "doorknob.h"
 
-static char *smtp_server;
-static char *smtp_user;
-static char *smtp_passwd;
 static char *mail_from;
-static int starttls;
 static int rewrite_from;
+static int max_messages = 100; // per session, 0 for no limit
+static int retry_min = 60;     // seconds
+static int retry_max = 3600;
+static int hashed_queue;
+
+#define MAX_WORKERS 32
+static int workers = 1; // sessions delivering in parallel
 
 static int foreground;
 static long debug;
-static int use_stderr;
-static int use_ssl;
+static int no_change; // -C, keep running as whoever started us
+
+/* The smarthosts. Each smtp-server line starts a new one, the
+ * server keys after it apply to it. Server keys before the first
+ * smtp-server are the defaults for all of them.
+ */
+#define MAX_SERVERS 16
+
+struct server {
+	char *host;
+	unsigned short port;
+	int use_ssl;
+	int starttls;
+	char *user;
+	char *passwd;
+	int weight;
+	int max_rate;         // messages a minute, 0 for no limit
+	long max_bytes;       // bytes a minute, 0 for no limit
+	struct dns_host *dns;
+
+	int current;          // smooth weighted round robin
+	int failures;         // in a row
+	int ejected;
+	int probing;          // a session is trying it out
+	long long probe_at;   // when an ejected server can be tried again
+
+	/* How many sessions it gets. Like TCP congestion control this
+	 * grows while the server keeps up and halves when it throttles
+	 * us or slows down.
+	 */
+	double limit;
+	double ssthresh;      // grow by one a message up to here
+	long long hold;       // no more cuts until then
+	long long lat_min;    // fastest final reply, ms
+
+	/* Token buckets for max-rate and max-bytes */
+	double msgs, bytes;
+	long long refill;
+};
+
+static struct server servers[MAX_SERVERS];
+static int nservers;
+static struct server defaults = { .weight = 1 };
+static int eject_after = 3;  // failures in a row
+static int eject_time = 30;  // seconds before a probe
 
-static short smtp_port = 25;
-static uint32_t smtp_addr; // ipv4 only
 static char hostname[HOST_NAME_MAX + 1];
 
+#define METRICS_SOCKET MAILDIR "/run/metrics"
+
 #ifndef WANT_SSL
-#define ssl_open(s, h) -1
-#define ssl_read(b, c) -1
-#define ssl_write(b, c) -1
-#define ssl_close()
+#define ssl_open(s, h) NULL
+#define ssl_pump(c) -1
+#define ssl_ready(c) 0
+#define ssl_ktls(c) 0
+#define ssl_read(c, b, n) -1
+#define ssl_write(c, b, n) -1
+#define ssl_flush(c)
+#define ssl_close(c)
 #endif
 
 #ifdef __QNX__
-#include <sys/slog2.h>
 #include <sys/procmgr.h>
+#endif
+
+#define AUTH_TYPE_PLAIN 1
+#define AUTH_TYPE_LOGIN 2
+
+#define MAX_ATTEMPTS  8  // addresses tried per connect
+#define ATTEMPT_DELAY 250 // ms, the RFC 8305 connection attempt delay
+
+/* Session states. Delivery is an explicit state machine so that one
+ * thread can drive all the sessions from a single poll() loop.
+ */
+enum {
+	S_IDLE,      // not connected
+	S_CONNECT,   // waiting for connect() to finish
+	S_HANDSHAKE, // waiting for the TLS handshake
+	S_GREETING,  // waiting for the 220
+	S_EHLO,
+	S_STARTTLS,
+	S_AUTH,
+	S_READY,     // connected with nothing outstanding
+	S_RSET,
+	S_ENVELOPE,  // MAIL FROM, RCPT TO and DATA
+	S_BODY,
+	S_DOT,       // waiting for the final reply
+	S_QUIT,
+};
+
+/* How long to wait on each step of the dialogue, in seconds. Set
+ * with timeout-<name>. The defaults are from RFC 5321 4.5.3.2. The
+ * envelope waits on its oldest command, so MAIL, RCPT and DATA each
+ * get their own. The body timeout is per write.
+ */
+enum { T_RCPT = S_QUIT + 1, T_DATA, T_MAX };
+
+static struct {
+	const char *name;
+	int secs;
+} timeouts[T_MAX] = {
+	[S_CONNECT]   = { "connect",   30 },
+	[S_HANDSHAKE] = { "handshake", 300 },
+	[S_GREETING]  = { "greeting",  300 },
+	[S_EHLO]      = { "ehlo",      300 },
+	[S_STARTTLS]  = { "starttls",  300 },
+	[S_AUTH]      = { "auth",      300 },
+	[S_READY]     = { "ready",     300 },
+	[S_RSET]      = { "rset",      300 },
+	[S_ENVELOPE]  = { "mail",      300 },
+	[S_BODY]      = { "body",      180 },
+	[S_DOT]       = { "dot",       600 },
+	[S_QUIT]      = { "quit",      300 },
+	[T_RCPT]      = { "rcpt",      300 },
+	[T_DATA]      = { "data",      120 },
+};
+
+/* The envelope for one message. If the server supports PIPELINING
+ * up to MAX_PIPELINE commands are sent before waiting for the replies,
+ * which are matched to the commands in order. Without PIPELINING the
+ * window is one command.
+ */
+#define MAX_PIPELINE 32
 
-static void logging_init(void)
+struct envelope {
+	char logout[1024];
+	int mail;       // MAIL FROM status: 0 ok, 1 failed, -2 no reply yet
+	int data;       // DATA status: 0 ok, 1 failed, -2 no reply yet
+	int count;      // accepted recipients
+	int temp;       // recipients that got a 4xx
+	int first_time; // no local recipient seen yet
+	int rcpts_done; // read all the recipients from the spool file
+	int data_sent;
+	int discard;    // sent a lone dot to end a DATA we didn't want
+	off_t body;     // where the message starts in the spool file
+
+	/* The recipients that got a 4xx, written out as a new spool
+	 * file so they can be retried without the others.
+	 */
+	FILE *retry;
+	char retry_name[16];
+
+	int head, n;    // commands waiting for a reply
+	struct {
+		int status;
+		char rcpt[MAX_ADDR];
+	} pending[MAX_PIPELINE];
+};
+
+/* One SMTP session */
+struct smtp {
+	int state;
+	int sock;
+	struct server *srv;
+	struct ssl_conn *ssl; // non-NULL once TLS is up
+	int want;             // poll events the TLS engine is waiting on
+	long long deadline;
+	int waiting;          // the timeout the deadline is for
+	long long since;      // when we started waiting
+	long long started;    // when the auth or data being timed began
+	long long picked;     // when the message was handed to us
+	long long queued;     // ms it waited in the queue
+	int sent;             // messages sent this session
+
+	int auth_type;        // set from ehlo reply
+	int auth_step;
+	int pipelining;       // set from ehlo reply
+	int looking_for_from;
+
+	/* The message being delivered */
+	char *fname;
+	FILE *fp;
+	int reused;           // the session had already sent a message
+
+	/* Connection attempts racing each other (RFC 8305). The
+	 * addresses tried are kept since the dns order can change under
+	 * us. sock is -1 once an attempt is over.
+	 */
+	int nattempts;
+	long long next_attempt;
+	struct {
+		int sock;
+		long long start;
+		struct sockaddr_storage addr;
+	} attempt[MAX_ATTEMPTS];
+	struct envelope env;
+
+	char obuf[16384];
+	int olen, opos;
+
+	/* Zero-copy body: send straight from the spool file */
+	int zerocopy;
+	off_t body_off, body_end;
+
+	/* This is here so other functions can parse the reply. Long
+	 * multi-line replies are cut short here, but every line is still
+	 * seen by reply_line().
+	 */
+	char reply[1501];
+	int replen;
+	int last_status;
+	int more;             // in the middle of a multi-line reply
+
+	/* Raw input from the server. With pipelining this can hold more
+	 * than one reply. Lines are consumed from rpos and a partial line
+	 * is kept for next time.
+	 */
+	char rbuf[4096];
+	int rlen, rpos;
+};
+
+static struct smtp sessions[MAX_WORKERS];
+
+static int stopping;
+
+static long long now_ms(void)
 {
-	slog2_buffer_t buffer_handle;
-	slog2_buffer_set_config_t buffer_config = {
-		.num_buffers = 1,
-		.buffer_set_name = "doorknob",
-		.verbosity_level = SLOG2_INFO,
-		.buffer_config[0].buffer_name = "doorknob",
-		.buffer_config[0].num_pages = 1,
-	};
+	struct timespec ts;
 
-	if (slog2_register(&buffer_config, &buffer_handle, 0)) {
-		fprintf(stderr, "Error registering slog2 buffer!\n");
-		exit(1);
-	}
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
 
-	slog2_set_default_buffer(buffer_handle);
+static void set_deadline(struct smtp *s, int t)
+{
+	s->waiting = t;
+	s->since = now_ms();
+	s->deadline = s->since + timeouts[t].secs * 1000LL;
 }
 
-static void sys_log(const char *msg)
+static void set_state(struct smtp *s, int state)
 {
-	slog2c(NULL, 0, SLOG2_INFO, msg);
+	s->state = state;
+	set_deadline(s, state);
 }
-#else
-static void logging_init(void)
+
+static int server_usable(struct server *srv, long long now)
 {
-	openlog("doorknob", 0, LOG_MAIL);
+	if (dns_count(srv->dns) == 0)
+		return 0;
+	return !srv->ejected || (!srv->probing && now >= srv->probe_at);
 }
 
-static void sys_log(const char *msg)
+static int server_active(struct server *srv)
 {
-	syslog(LOG_INFO, "%s", msg);
+	int i, n = 0;
+
+	for (i = 0; i < workers; ++i)
+		if (sessions[i].srv == srv && sessions[i].state != S_IDLE)
+			++n;
+	return n;
 }
-#endif
 
-static inline int write_string(char *str)
+static void server_refill(struct server *srv, long long now)
 {
-	strcat(str, "\n");
-	return write(2, str, strlen(str));
+	double secs = (now - srv->refill) / 1000.0;
+
+	srv->refill = now;
+	// Allow a burst of up to a second's worth
+	if (srv->max_rate) {
+		double burst = srv->max_rate > 60 ? srv->max_rate / 60.0 : 1;
+		srv->msgs += secs * srv->max_rate / 60;
+		if (srv->msgs > burst)
+			srv->msgs = burst;
+	}
+	if (srv->max_bytes) {
+		srv->bytes += secs * srv->max_bytes / 60;
+		if (srv->bytes > srv->max_bytes / 60.0)
+			srv->bytes = srv->max_bytes / 60.0;
+	}
 }
 
-void logmsg(const char *fmt, ...)
+/* Returns how long until the rate limits allow another message */
+static long long server_wait(struct server *srv, long long now)
 {
-	va_list ap;
-	char msg[128];
+	double wait = 0, w;
 
-	va_start(ap, fmt);
-	vsnprintf(msg, sizeof(msg) - 1, fmt, ap);
-	va_end(ap);
+	server_refill(srv, now);
+	if (srv->max_rate && srv->msgs < 1) {
+		w = (1 - srv->msgs) * 60000 / srv->max_rate;
+		if (w > wait)
+			wait = w;
+	}
+	// A big message can leave the bytes in debt
+	if (srv->max_bytes && srv->bytes < 0) {
+		w = -srv->bytes * 60000 / srv->max_bytes;
+		if (w > wait)
+			wait = w;
+	}
+	return (long long)wait + (wait > 0);
+}
 
-	if (use_stderr)
-		write_string(msg);
+/* Take a message from the rate limits. Returns 0 if we have to wait. */
+static int server_take(struct server *srv, long long now)
+{
+	if (server_wait(srv, now))
+		return 0;
+	if (srv->max_rate)
+		srv->msgs -= 1;
+	return 1;
+}
+
+/* Pick a server for a new session. An ejected server that is due a
+ * probe gets it, otherwise the healthy servers share the sessions by
+ * weight (nginx's smooth weighted round robin). Returns NULL if there
+ * is nothing to use right now.
+ */
+static struct server *server_pick(long long now)
+{
+	struct server *best = NULL;
+	int i, total = 0;
+
+	for (i = 0; i < nservers; ++i) {
+		struct server *srv = &servers[i];
+		if (!server_usable(srv, now) || server_active(srv) >= (int)srv->limit ||
+			server_wait(srv, now))
+			continue;
+		if (srv->ejected) {
+			srv->probing = 1;
+			server_take(srv, now);
+			return srv;
+		}
+		srv->current += srv->weight;
+		total += srv->weight;
+		if (!best || srv->current > best->current)
+			best = srv;
+	}
+
+	if (best) {
+		best->current -= total;
+		server_take(best, now);
+	}
+	return best;
+}
+
+/* Returns when server_pick() may next find a server, -1 if it has to
+ * wait on dns or for a session to finish.
+ */
+static long long server_ready(long long now)
+{
+	long long when = -1;
+	int i;
+
+	for (i = 0; i < nservers; ++i) {
+		struct server *srv = &servers[i];
+		if (dns_count(srv->dns) == 0 || (srv->ejected && srv->probing) ||
+			server_active(srv) >= (int)srv->limit)
+			continue;
+		long long t = srv->ejected ? srv->probe_at : now;
+		long long rate = now + server_wait(srv, now);
+		if (rate > t)
+			t = rate;
+		if (when < 0 || t < when)
+			when = t;
+	}
+
+	return when;
+}
+
+/* Replies that mean slow down */
+static int throttled(int status)
+{
+	return status == 421 || status == 450 || status == 451;
+}
+
+/* The server took a message and answered the final dot in ms */
+static void server_faster(struct server *srv, long long ms)
+{
+	if (srv->lat_min == 0 || ms < srv->lat_min)
+		srv->lat_min = ms;
 	else
-		sys_log(msg);
+		srv->lat_min += (ms - srv->lat_min) / 64; // let it drift up
+
+	if (srv->limit >= workers)
+		return;
+	if (srv->limit < srv->ssthresh)
+		srv->limit += 1;
+	else
+		srv->limit += 1 / srv->limit;
+	if (srv->limit > workers)
+		srv->limit = workers;
+}
+
+/* The server is pushing back, once a second at most */
+static void server_slower(struct server *srv, long long now, const char *why)
+{
+	if (now < srv->hold)
+		return;
+	srv->hold = now + 1000;
+
+	srv->limit /= 2;
+	if (srv->limit < 1)
+		srv->limit = 1;
+	srv->ssthresh = srv->limit;
+	if (debug)
+		logmsg("%s: %s, down to %d sessions", srv->host, why, (int)srv->limit);
+}
+
+/* The server did its job */
+static void server_ok(struct server *srv)
+{
+	srv->failures = 0;
+	srv->probing = 0;
+	if (srv->ejected) {
+		srv->ejected = 0;
+		logmsg("%s: back in service", srv->host);
+	}
+}
+
+static void server_failed(struct server *srv)
+{
+	long long now = now_ms();
+
+	if (srv->ejected) {
+		// The probe failed
+		srv->probing = 0;
+		srv->probe_at = now + eject_time * 1000LL;
+	} else if (++srv->failures >= eject_after && nservers > 1) {
+		srv->ejected = 1;
+		srv->probe_at = now + eject_time * 1000LL;
+		logmsg("%s: out of service after %d failures", srv->host, srv->failures);
+	}
 }
 
-static int looking_for_from;
-static size_t read_callback(char *buffer, size_t size, size_t nitems, void *fp)
+static size_t read_callback(struct smtp *s, char *buffer, size_t size, FILE *fp)
 {
-	if (looking_for_from) {
-		if (fgets(buffer, size * nitems, fp)) {
+	if (s->looking_for_from) {
+		if (fgets(buffer, size, fp)) {
 			if (strncmp(buffer, "From:", 5) == 0) {
-				looking_for_from = 0;
+				s->looking_for_from = 0;
 				char *p = strchr(buffer, '<');
 				if (p)
 					sprintf(p + 1, "%s>\n", mail_from);
@@ -136,13 +489,13 @@ static size_t read_callback(char *buffer, size_t size, size_t nitems, void *fp)
 					sprintf(buffer, "From: %s\n", mail_from);
 			} else if (*buffer == '\n' || *buffer == '\r')
 				// end of header - no From
-				looking_for_from = 0;
+				s->looking_for_from = 0;
 			return strlen(buffer);
 		}
 		return 0;
 	}
 
-	return fread(buffer, size, nitems, fp);
+	return fread(buffer, 1, size, fp);
 }
 
 static int open_spool_file(const char *fname, FILE **fp)
@@ -163,287 +516,1128 @@ static int open_spool_file(const char *fname, FILE **fp)
 	return 0;
 }
 
-static int read_socket(int sock, void *buf, int count)
+static int read_socket(struct smtp *s, void *buf, int count)
 {
-	if (use_ssl)
-		return ssl_read(buf, count);
+	if (s->ssl)
+		return ssl_read(s->ssl, buf, count);
 	else
-		return read(sock, buf, count);
+		return read(s->sock, buf, count);
 }
 
-static int write_socket(int sock, const void *buf, int count)
+static int write_socket(struct smtp *s, const void *buf, int count)
 {
-	if (use_ssl)
-		return ssl_write(buf, count);
+	if (s->ssl)
+		return ssl_write(s->ssl, buf, count);
 	else
-		return write(sock, buf, count);
+		return write(s->sock, buf, count);
 }
 
-/* This is global so other functions can parse the reply */
-static char reply[1501];
-
-static int expect_status(int sock, int status)
+/* Queue a command. It goes out when the socket is writable. */
+static int send_cmd(struct smtp *s, const char *str)
 {
-	int n = read_socket(sock, reply, sizeof(reply) - 1);
-	if (n <= 0) {
-		logmsg("read: %s", strerror(errno));
+	int len = strlen(str);
+
+	if (debug)
+		log_lines("C: ", str, len);
+
+	if (s->opos) {
+		s->olen -= s->opos;
+		memmove(s->obuf, s->obuf + s->opos, s->olen);
+		s->opos = 0;
+	}
+
+	if (s->olen + len > sizeof(s->obuf)) {
+		logmsg("Output buffer full");
 		return -1;
 	}
-	reply[n] = 0;
 
-	if (debug)
-		printf("S: %s", reply);
+	memcpy(s->obuf + s->olen, str, len);
+	s->olen += len;
+	return 0;
+}
 
-	int got = strtol(reply, NULL, 10);
-	if (status != got) {
-		logmsg("Expected %d got %s", status, reply);
+static int check_status(struct smtp *s, int status)
+{
+	if (s->last_status != status) {
+		logmsg("Expected %d got %s", status, s->reply);
 		return 1;
 	}
 
 	return 0;
 }
 
-/* Returns 0 on success, -1 on I/O error, and 1 if status is wrong */
-static int send_str(int sock, const char *str, int status)
+static void session_close(struct smtp *s)
 {
-	if (debug)
-		printf("C: %s", str);
+	int n;
 
-	int len = strlen(str);
-	int n = write_socket(sock, str, len);
-	if (n != len) {
-		if (n < 0)
-			logmsg("write %s: %s", str, strerror(errno));
-		else
-			logmsg("Short write: %d/%d", n, len);
+	for (n = 0; n < s->nattempts; ++n)
+		if (s->attempt[n].sock != -1) {
+			close(s->attempt[n].sock);
+			s->attempt[n].sock = -1;
+		}
+	if (s->ssl) {
+		ssl_close(s->ssl);
+		s->ssl = NULL;
+	}
+	if (s->sock != -1) {
+		close(s->sock);
+		s->sock = -1;
+	}
+	s->olen = s->opos = s->rlen = s->rpos = s->more = 0;
+	s->state = S_IDLE;
+}
+
+static void smtp_quit(struct smtp *s)
+{
+	if (send_cmd(s, "QUIT\r\n"))
+		session_close(s);
+	else
+		set_state(s, S_QUIT);
+}
+
+static void rcpts_discard(struct envelope *env)
+{
+	if (env->retry) {
+		fclose(env->retry);
+		unlink(env->retry_name);
+		env->retry = NULL;
+	}
+}
+
+/* Keep a recipient that got a 4xx to retry on its own. If it can't
+ * be kept the whole message is retried.
+ */
+static void rcpt_defer(struct envelope *env, const char *rcpt)
+{
+	++env->temp;
+	if (!env->retry) {
+		if (env->temp > 1)
+			return; // already failed
+		// A dot file so the queue ignores it
+		strcpy(env->retry_name, ".rcpt.XXXXXX");
+		int fd = mkstemp(env->retry_name);
+		if (fd < 0 || !(env->retry = fdopen(fd, "w"))) {
+			logmsg("%s: %s", env->retry_name, strerror(errno));
+			if (fd >= 0) {
+				close(fd);
+				unlink(env->retry_name);
+			}
+			return;
+		}
+	}
+	fprintf(env->retry, "%s\n", rcpt);
+}
+
+/* Replace the spool file with one for just the recipients that got
+ * a 4xx. If that fails the message is left as it was, so everyone
+ * gets it again rather than some never getting it.
+ */
+static void rcpts_requeue(struct smtp *s)
+{
+	struct envelope *env = &s->env;
+	char buf[8192];
+	size_t n;
+
+	if (!env->retry)
+		return;
+
+	fputc('\n', env->retry);
+	if (fseeko(s->fp, env->body, SEEK_SET))
+		goto failed;
+	while ((n = fread(buf, 1, sizeof(buf), s->fp)) > 0)
+		if (fwrite(buf, 1, n, env->retry) != n)
+			goto failed;
+	if (ferror(s->fp) || fflush(env->retry) || fsync(fileno(env->retry)))
+		goto failed;
+	// Same as sendmail leaves them
+	fchmod(fileno(env->retry), 0666);
+	if (rename(env->retry_name, s->fname))
+		goto failed;
+
+	fclose(env->retry);
+	env->retry = NULL;
+	return;
+
+failed:
+	logmsg("%s: %s", env->retry_name, strerror(errno));
+	rcpts_discard(env);
+}
+
+/* Finished with the current message. rc is 0 if the message is done
+ * with (sent or rejected) and 1 if it should be retried later.
+ */
+static void msg_done(struct smtp *s, int rc)
+{
+	rcpts_discard(&s->env);
+
+	if (s->fp) {
+		fclose(s->fp);
+		s->fp = NULL;
+		++s->sent;
+	}
+
+	if (rc == 0) {
+		if (unlink(s->fname))
+			logmsg("unlink %s: %s", s->fname, strerror(errno));
+		queue_done(s->fname);
+	} else {
+		metric_add(M_DEFERRED, 1);
+		queue_retry(s->fname, now_ms());
+	}
+
+	s->fname = NULL;
+}
+
+static int queue_rcpt(struct smtp *s, const char *cmd, int status, const char *rcpt)
+{
+	struct envelope *env = &s->env;
+	int i = (env->head + env->n) % MAX_PIPELINE;
+
+	if (send_cmd(s, cmd))
 		return -1;
+
+	env->pending[i].status = status;
+	strlcpy(env->pending[i].rcpt, rcpt ? rcpt : "", sizeof(env->pending[i].rcpt));
+	++env->n;
+	return 0;
+}
+
+static int envelope_finish(struct smtp *s)
+{
+	struct envelope *env = &s->env;
+
+	if (env->mail)
+		msg_done(s, 1);
+	else if (env->count == 0) {
+		logmsg("%s", env->logout);
+		if (env->temp) {
+			// Try again later for the ones that might take it
+			rcpts_requeue(s);
+			msg_done(s, 1);
+		} else {
+			// Nobody wants it
+			metric_add(M_BOUNCED, 1);
+			msg_done(s, 0);
+		}
+	} else if (env->data)
+		msg_done(s, 1);
+	else {
+		s->looking_for_from = rewrite_from;
+		s->zerocopy = 0;
+		s->started = now_ms();
+		set_state(s, S_BODY);
+		return 0;
 	}
 
-	return expect_status(sock, status);
+	set_state(s, S_READY);
+	return 0;
 }
 
-static int send_body(int sock, FILE *fp)
+/* Queue as much of the envelope as the window allows. */
+static int envelope_fill(struct smtp *s)
 {
-	char buffer[4096];
-	int n;
+	struct envelope *env = &s->env;
+	int window = s->pipelining ? MAX_PIPELINE : 1;
+	char buffer[1024], line[MAX_ADDR], *p;
+
+	while (env->n < window && !env->data_sent && env->mail <= 0) {
+		if (!env->rcpts_done) {
+			if (!fgets(line, sizeof(line), s->fp) || *line == '\n') {
+				env->rcpts_done = 1;
+				env->body = ftello(s->fp);
+				continue;
+			}
+			strtok(line, "\r\n");
+			p = strchr(line, '@');
+			if (p)
+				strconcat(buffer, sizeof(buffer), "RCPT TO:<", line, ">\r\n", NULL);
+			else {
+				if (env->first_time) {
+					env->first_time = 0;
+					strlcpy(line, mail_from, sizeof(line));
+					strconcat(buffer, sizeof(buffer), "RCPT TO:<", mail_from, ">\r\n", NULL);
+				} else
+					continue;
+			}
+			if (queue_rcpt(s, buffer, 250, line))
+				return -1;
+			continue;
+		}
+
+		// Without pipelining there is no point asking for DATA if
+		// nobody wants the message. With pipelining we ask blind.
+		if (!s->pipelining && env->count == 0)
+			break;
+		if (queue_rcpt(s, "DATA\r\n", 354, NULL))
+			return -1;
+		env->data_sent = 1;
+	}
 
-	looking_for_from = rewrite_from;
+	if (env->n)
+		return 0; // wait for the replies
 
-	// This could be more efficient for the rewrite_from case
-	while ((n = read_callback(buffer, 1, sizeof(buffer), fp)) > 0) {
-		int wrote = write_socket(sock, buffer, n);
-		if (wrote != n)
+	if (env->data == 0 && (env->mail || env->count == 0)) {
+		// The server wants a body we aren't going to send
+		env->discard = 1;
+		if (send_cmd(s, ".\r\n"))
 			return -1;
-		if (debug > 1)
-			printf("B: %.*s", n, buffer);
+		set_state(s, S_DOT);
+		return 0;
 	}
 
-	if (ferror(fp)) {
-		logmsg("read file: %s", strerror(errno));
+	return envelope_finish(s);
+}
+
+static int envelope_start(struct smtp *s)
+{
+	struct envelope *env = &s->env;
+	char buffer[1024];
+
+	rcpts_discard(env);
+	env->mail = env->data = -2;
+	env->count = env->temp = env->head = env->n = 0;
+	env->first_time = 1;
+	env->rcpts_done = env->data_sent = env->discard = 0;
+	strlcpy(env->logout, s->fname, sizeof(env->logout));
+
+	set_state(s, S_ENVELOPE);
+
+	strconcat(buffer, sizeof(buffer), "MAIL FROM:<", mail_from, ">\r\n", NULL);
+	if (queue_rcpt(s, buffer, 250, NULL))
+		return -1;
+
+	return envelope_fill(s);
+}
+
+/* Time the oldest outstanding envelope command */
+static void envelope_deadline(struct smtp *s)
+{
+	struct envelope *env = &s->env;
+	int i = env->head;
+
+	if (env->n == 0)
+		return;
+	if (*env->pending[i].rcpt)
+		set_deadline(s, T_RCPT);
+	else if (env->pending[i].status == 354)
+		set_deadline(s, T_DATA);
+	else
+		set_deadline(s, S_ENVELOPE);
+}
+
+/* Match one reply to the oldest outstanding envelope command */
+static int envelope_reply(struct smtp *s)
+{
+	struct envelope *env = &s->env;
+
+	if (env->n == 0) {
+		logmsg("Unexpected reply %s", s->reply);
 		return -1;
 	}
 
-	return send_str(sock, "\r\n.\r\n", 250);
+	int i = env->head;
+	env->head = (env->head + 1) % MAX_PIPELINE;
+	--env->n;
+
+	int n = check_status(s, env->pending[i].status);
+	if (s->last_status == 421)
+		return -1;
+
+	if (*env->pending[i].rcpt) {
+		strlcat(env->logout, " ", sizeof(env->logout));
+		strlcat(env->logout, env->pending[i].rcpt, sizeof(env->logout));
+		if (n) {
+			strlcat(env->logout, "(X)", sizeof(env->logout));
+			if (s->last_status >= 400 && s->last_status < 500)
+				rcpt_defer(env, env->pending[i].rcpt);
+		} else
+			++env->count;
+	} else if (env->pending[i].status == 354)
+		env->data = n;
+	else
+		env->mail = n;
+
+	if (envelope_fill(s))
+		return -1;
+	if (s->state == S_ENVELOPE)
+		envelope_deadline(s);
+	return 0;
 }
 
-#define AUTH_TYPE_PLAIN 1
-#define AUTH_TYPE_LOGIN 2
+/* Returns -1 if the session should be dropped */
+static int msg_start(struct smtp *s)
+{
+	int rc = open_spool_file(s->fname, &s->fp);
+	if (rc < 0 && errno == ENOENT) {
+		// Someone else removed it
+		queue_done(s->fname);
+		s->fname = NULL;
+		return 0;
+	}
+	if (rc) {
+		if (rc < 0)
+			logmsg("open %s: %s", s->fname, strerror(errno));
+		msg_done(s, rc < 0 ? 1 : 0);
+		return 0;
+	}
 
-static int auth_type; // set from ehlo reply
+	s->reused = s->sent > 0;
+	if (s->reused) {
+		set_state(s, S_RSET);
+		return send_cmd(s, "RSET\r\n");
+	}
+
+	return envelope_start(s);
+}
 
-static int send_ehlo(int sock)
+/* Once there is nothing left to rewrite the rest of the spool file
+ * can go out as is. For plain sockets, or TLS with the keys in the
+ * kernel, let the kernel do the copy.
+ */
+static int body_zerocopy(struct smtp *s)
 {
-	char buffer[128], *p, *e;
+#ifdef __linux__
+	struct stat sbuf;
 
-	strconcat(buffer, sizeof(buffer), "EHLO ", hostname, "\r\n", NULL);
-	if (send_str(sock, buffer, 250))
+	if (s->looking_for_from || (s->ssl && !ssl_ktls(s->ssl)) || debug > 1)
+		return 0;
+	if (fstat(fileno(s->fp), &sbuf))
+		return 0;
+
+	// ftell() accounts for what stdio has buffered
+	s->body_off = ftello(s->fp);
+	if (s->body_off < 0)
+		return 0;
+	s->body_end = sbuf.st_size;
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+/* Returns > 0 on progress, 0 if the socket is full, -1 on error */
+static int body_sendfile(struct smtp *s)
+{
+#ifdef __linux__
+	if (s->body_off < s->body_end) {
+		ssize_t n = sendfile(s->sock, fileno(s->fp), &s->body_off,
+							 s->body_end - s->body_off);
+		if (n > 0)
+			return n;
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+				return 0;
+			logmsg("sendfile: %s", strerror(errno));
+			return -1;
+		}
+		// The file shrank under us
+		s->body_end = s->body_off;
+	}
+#endif
+
+	s->zerocopy = 0;
+	set_state(s, S_DOT);
+	if (send_cmd(s, "\r\n.\r\n"))
 		return -1;
+	return 1;
+}
 
-	// For starttls this may change so reset
-	auth_type = 0;
+/* Fill the output buffer from the spool file */
+static int body_fill(struct smtp *s)
+{
+	int n = read_callback(s, s->obuf, sizeof(s->obuf), s->fp);
+	if (n > 0) {
+		if (debug > 1)
+			log_lines("B: ", s->obuf, n);
+		s->olen = n;
+		return n;
+	}
 
-	p = strstr(reply, "250-AUTH");
-	if (p) {
-		e = strchr(p, '\n');
-		if (e)
-			*e = 0;
+	if (ferror(s->fp)) {
+		logmsg("read file: %s", strerror(errno));
+		return -1;
+	}
+
+	set_state(s, S_DOT);
+	return send_cmd(s, "\r\n.\r\n");
+}
+
+static void send_ehlo(struct smtp *s)
+{
+	char buffer[128];
+
+	strconcat(buffer, sizeof(buffer), "EHLO ", hostname, "\r\n", NULL);
+	if (send_cmd(s, buffer) == 0)
+		set_state(s, S_EHLO);
+}
+
+/* One capability line from the ehlo reply, without the status */
+static void parse_ehlo(struct smtp *s, const char *p, int len)
+{
+	char line[128];
+
+	if (len >= sizeof(line))
+		len = sizeof(line) - 1;
+	memcpy(line, p, len);
+	line[len] = 0;
+	strtok(line, "\r\n");
+
+	if (strcasecmp(line, "PIPELINING") == 0)
+		s->pipelining = 1;
+	else if (strncasecmp(line, "AUTH", 4) == 0 && (line[4] == ' ' || line[4] == '=')) {
 		// Prefer auth plain over auth login
-		if (strstr(p, "PLAIN"))
-			auth_type = AUTH_TYPE_PLAIN;
-		else if (strstr(p, "LOGIN"))
-			auth_type = AUTH_TYPE_LOGIN;
+		if (strstr(line, "PLAIN"))
+			s->auth_type = AUTH_TYPE_PLAIN;
+		else if (strstr(line, "LOGIN") && !s->auth_type)
+			s->auth_type = AUTH_TYPE_LOGIN;
+	}
+}
+
+static int auth_user(struct smtp *s)
+{
+	char buffer[1024];
+
+	if (s->auth_type == AUTH_TYPE_PLAIN) {
+		char authplain[512];
+
+		mkauthplain(s->srv->user, s->srv->passwd, authplain, sizeof(authplain));
+		strconcat(buffer, sizeof(buffer), "AUTH PLAIN ", authplain, "\r\n", NULL);
+	} else if (s->auth_step == 0)
+		strlcpy(buffer, "AUTH LOGIN\r\n", sizeof(buffer));
+	else {
+		// We assume user then password... we should actually check reply
+		char *str = s->auth_step == 1 ? s->srv->user : s->srv->passwd;
+
+		base64_encode(buffer, sizeof(buffer) - 2, (uint8_t *)str, strlen(str));
+		strcat(buffer, "\r\n");
 	}
 
+	set_state(s, S_AUTH);
+	return send_cmd(s, buffer);
+}
+
+/* The connection is up, start TLS if it is smtps */
+static int connected(struct smtp *s)
+{
+	if (s->srv->use_ssl && !s->srv->starttls) {
+		s->ssl = ssl_open(s->sock, s->srv->host);
+		if (!s->ssl)
+			return -1;
+		s->want = POLLIN | POLLOUT;
+		set_state(s, S_HANDSHAKE);
+	} else
+		set_state(s, S_GREETING);
+
 	return 0;
 }
 
-static int open_and_connect(void)
+/* Returns the best address this connect has not tried yet */
+static const struct sockaddr *next_addr(struct smtp *s, socklen_t *len)
 {
-	int sock = socket(AF_INET, SOCK_STREAM, 0);
-	if (sock == -1) {
-		logmsg("socket: %s", strerror(errno));
-		return -1;
+	int i, n;
+
+	for (i = 0; i < dns_count(s->srv->dns); ++i) {
+		const struct sockaddr *sa = dns_addr(s->srv->dns, i, len);
+		for (n = 0; n < s->nattempts; ++n)
+			if (memcmp(&s->attempt[n].addr, sa, *len) == 0)
+				break;
+		if (n == s->nattempts)
+			return sa;
 	}
 
-	int flags = 1;
-	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &flags, sizeof(flags));
+	return NULL;
+}
 
-	struct sockaddr_in sock_name;
-	memset(&sock_name, 0, sizeof(sock_name));
-	sock_name.sin_family = AF_INET;
-	sock_name.sin_addr.s_addr = smtp_addr;
-	sock_name.sin_port = htons(smtp_port);
+static int attempts_active(struct smtp *s)
+{
+	int n, active = 0;
 
-	if (connect(sock, (struct sockaddr *)&sock_name, sizeof(sock_name))) {
-		logmsg("connect: %s", strerror(errno));
-		close(sock);
-		return -1;
-	}
+	for (n = 0; n < s->nattempts; ++n)
+		if (s->attempt[n].sock != -1)
+			++active;
+	return active;
+}
 
-	// starttls defers the ssl_open
-	if (use_ssl && !starttls) {
-		if (ssl_open(sock, smtp_server)) {
+/* Start a non-blocking connect to the next address. Addresses that
+ * fail right away are skipped. Returns -1 if we are out of addresses.
+ */
+static int start_attempt(struct smtp *s, long long now)
+{
+	const struct sockaddr *sa;
+	socklen_t len;
+
+	while (s->nattempts < MAX_ATTEMPTS && (sa = next_addr(s, &len))) {
+		int n = s->nattempts++;
+		memcpy(&s->attempt[n].addr, sa, len);
+		s->attempt[n].start = now;
+		s->attempt[n].sock = -1;
+
+		int sock = socket(sa->sa_family, SOCK_STREAM, 0);
+		if (sock == -1) {
+			logmsg("socket: %s", strerror(errno));
+			dns_report(s->srv->dns, sa, -1);
+			continue;
+		}
+
+		int flags = 1;
+		setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &flags, sizeof(flags));
+		fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+
+		if (connect(sock, sa, len) && errno != EINPROGRESS) {
+			logmsg("connect: %s", strerror(errno));
+			dns_report(s->srv->dns, sa, -1);
 			close(sock);
-			return -1;
+			continue;
 		}
+
+		// Even if it connected right away let attempt_done() sort it out
+		s->attempt[n].sock = sock;
+		s->next_attempt = now + ATTEMPT_DELAY;
+		return 0;
 	}
 
-	return sock;
+	s->next_attempt = s->deadline; // nothing more to start
+	return -1;
 }
 
-static int auth_user(int sock, char *buffer, size_t bufsize)
+/* Start connecting. The addresses are raced: a new attempt starts
+ * every ATTEMPT_DELAY ms until one connects or timeout-connect runs
+ * out. Returns -1 if it failed outright.
+ */
+static int session_connect(struct smtp *s)
 {
-	if (auth_type == AUTH_TYPE_PLAIN) {
-		char authplain[512];
+	long long now = now_ms();
+
+	s->nattempts = 0;
+	s->sock = -1;
+	s->ssl = NULL;
+	s->sent = 0;
+	s->olen = s->opos = s->rlen = s->rpos = s->more = 0;
+
+	set_state(s, S_CONNECT);
+
+	if (start_attempt(s, now)) {
+		session_close(s);
+		return -1;
+	}
+	return 0;
+}
+
+/* The session is broken. A message that was on a reused session gets
+ * one more try on a fresh connection, since the server may just have
+ * dropped an idle connection.
+ */
+static void session_fail(struct smtp *s)
+{
+	// Nothing was outstanding, the server can drop an idle session
+	int quitting = s->state == S_QUIT || (s->state == S_READY && !s->fname);
+
+	session_close(s);
+
+	if (s->fname && s->reused && s->fp) {
+		// The new connection starts the recipients over
+		rcpts_discard(&s->env);
+		fclose(s->fp);
+		s->fp = NULL;
+		s->reused = 0;
+		if (session_connect(s) == 0)
+			return;
+	}
+
+	if (!quitting) {
+		metric_add(M_FAILURES, 1);
+		server_failed(s->srv);
+	}
+	if (s->fname)
+		msg_done(s, 1);
+}
+
+/* Connection attempt n is writable, so it either connected or failed */
+static void attempt_done(struct smtp *s, int n, long long now)
+{
+	int err = 0;
+	socklen_t len = sizeof(err);
+	struct sockaddr *sa = (struct sockaddr *)&s->attempt[n].addr;
+	int sock = s->attempt[n].sock;
+
+	s->attempt[n].sock = -1;
+
+	getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &len);
+	if (err) {
+		logmsg("connect: %s", strerror(err));
+		dns_report(s->srv->dns, sa, -1);
+		close(sock);
+		// Nothing left in the race, don't wait out the delay
+		if (attempts_active(s) == 0)
+			s->next_attempt = now;
+		return;
+	}
+
+	// The winner. The others are dropped without counting against them.
+	dns_report(s->srv->dns, sa, now - s->attempt[n].start);
+	metric_add(M_CONNECTS, 1);
+	metrics_time(H_CONNECT, now - s->since);
+	session_close(s);
+	s->sock = sock;
+
+	if (connected(s))
+		session_fail(s);
+}
 
-		mkauthplain(smtp_user, smtp_passwd, authplain, sizeof(authplain));
-		strconcat(buffer, bufsize, "AUTH PLAIN ", authplain, "\r\n", NULL);
-		if (send_str(sock, buffer, 235))
+/* Called for a session in S_CONNECT with the poll results for its
+ * attempts, one pollfd per attempt.
+ */
+static void connect_step(struct smtp *s, struct pollfd *fds, long long now)
+{
+	int n;
+
+	for (n = 0; n < s->nattempts && s->state == S_CONNECT; ++n)
+		if (fds[n].revents && s->attempt[n].sock != -1)
+			attempt_done(s, n, now);
+
+	if (s->state != S_CONNECT)
+		return;
+
+	if (now >= s->deadline) {
+		logmsg("Connect timeout");
+		for (n = 0; n < s->nattempts; ++n)
+			if (s->attempt[n].sock != -1)
+				dns_report(s->srv->dns, (struct sockaddr *)&s->attempt[n].addr, -1);
+		session_fail(s);
+	} else if (now >= s->next_attempt && start_attempt(s, now) &&
+			   attempts_active(s) == 0)
+		session_fail(s); // every address failed
+}
+
+/* A probe only has to get this far to put the server back */
+static void logged_in(struct smtp *s)
+{
+	if (s->state == S_AUTH)
+		metrics_time(H_AUTH, now_ms() - s->started);
+	if (s->srv->probing)
+		server_ok(s->srv);
+	set_state(s, S_READY);
+}
+
+/* Handle one complete reply. Returns -1 if the session should be
+ * dropped.
+ */
+static int on_reply(struct smtp *s)
+{
+	struct envelope *env = &s->env;
+
+	metrics_reply(s->last_status);
+	if (throttled(s->last_status))
+		server_slower(s->srv, now_ms(), "throttled");
+
+	switch (s->state) {
+	case S_GREETING:
+		if (check_status(s, 220))
 			return -1;
-	} else if (auth_type == AUTH_TYPE_LOGIN) {
-		char user64[128], passwd64[256];
+		send_ehlo(s);
+		return 0;
 
-		base64_encode(user64, sizeof(user64) - 2, (uint8_t *)smtp_user, strlen(smtp_user));
-		base64_encode(passwd64, sizeof(passwd64) - 2, (uint8_t *)smtp_passwd, strlen(smtp_passwd));
-		strcat(user64, "\r\n");
-		strcat(passwd64, "\r\n");
+	case S_EHLO:
+		if (check_status(s, 250))
+			return -1;
+		if (s->srv->starttls && !s->ssl) {
+			set_state(s, S_STARTTLS);
+			return send_cmd(s, "STARTTLS\r\n");
+		}
+		if (s->srv->user && s->auth_type) {
+			s->auth_step = 0;
+			s->started = now_ms();
+			return auth_user(s);
+		}
+		logged_in(s);
+		return 0;
 
-		// We assume user then password... we should actually check reply
-		if (send_str(sock, "AUTH LOGIN\r\n", 334))
+	case S_STARTTLS:
+		if (check_status(s, 220))
 			return -1;
-		if (send_str(sock, user64, 334))
+		// Anything that arrived after the 220 was not encrypted, throw it away
+		s->rlen = s->rpos = 0;
+		s->ssl = ssl_open(s->sock, s->srv->host);
+		if (!s->ssl)
 			return -1;
-		if (send_str(sock, passwd64, 235))
+		s->want = POLLIN | POLLOUT;
+		set_state(s, S_HANDSHAKE);
+		return 0;
+
+	case S_AUTH: {
+		int last = s->auth_type == AUTH_TYPE_PLAIN ? 0 : 2;
+		if (check_status(s, s->auth_step == last ? 235 : 334))
 			return -1;
+		if (s->auth_step++ < last)
+			return auth_user(s);
+		logged_in(s);
+		return 0;
 	}
 
-	return 0;
-}
+	case S_RSET:
+		if (check_status(s, 250))
+			return -1;
+		return envelope_start(s);
+
+	case S_ENVELOPE:
+		return envelope_reply(s);
+
+	case S_DOT:
+		if (env->discard)
+			return envelope_finish(s);
+		metrics_time(H_DATA, now_ms() - s->started);
+		if (check_status(s, 250)) {
+			if (s->last_status == 421)
+				return -1;
+			// A permanent failure will never get through
+			if (s->last_status < 500)
+				server_failed(s->srv); // maybe throttling us
+			else
+				metric_add(M_BOUNCED, 1);
+			msg_done(s, s->last_status >= 500 ? 0 : 1);
+		} else {
+			long long now = now_ms(), ms = now - s->since;
+			logmsg("%s", env->logout);
+			metric_add(M_DELIVERED, 1);
+			if (s->queued >= 0)
+				metrics_latency(s->queued, now - s->picked);
+			server_ok(s->srv);
+			// Much slower than it can be means it is struggling
+			if (s->srv->lat_min && ms > 2 * s->srv->lat_min + 100)
+				server_slower(s->srv, now, "slow replies");
+			server_faster(s->srv, ms);
+			if (env->temp)
+				rcpts_requeue(s);
+			msg_done(s, env->temp > 0);
+		}
+		set_state(s, S_READY);
+		return 0;
 
-static int start_starttls(int sock)
-{
-	use_ssl = 0; // turn it off for first hello
+	case S_QUIT:
+		session_close(s);
+		return 0;
 
-	expect_status(sock, 220);
+	default:
+		if (s->last_status == 421) {
+			logmsg("%s", s->reply);
+			return -1;
+		}
+		logmsg("Unexpected reply %s", s->reply);
+		return 0;
+	}
+}
 
-	if (send_ehlo(sock))
+/* Handle one line of a reply, including the newline. Returns 1 when
+ * the reply is complete, 0 if more lines follow, -1 if the line is
+ * not a reply.
+ */
+static int reply_line(struct smtp *s, const char *line, int len)
+{
+	if (len < 4 || !isdigit(line[0]) || !isdigit(line[1]) || !isdigit(line[2]) ||
+		!strchr(" -\r\n", line[3])) {
+		logmsg("Bad reply %.*s", len, line);
 		return -1;
+	}
 
-	if (send_str(sock, "STARTTLS\r\n", 220))
-		return -1;
+	int status = strtol(line, NULL, 10);
+	if (s->more) {
+		if (status != s->last_status) {
+			logmsg("Bad continuation %.*s", len, line);
+			return -1;
+		}
+		if (s->state == S_EHLO)
+			parse_ehlo(s, line + 4, len - 4);
+	} else {
+		s->last_status = status;
+		s->replen = 0;
+		if (s->state == S_EHLO) {
+			// For starttls this may change so reset
+			s->auth_type = 0;
+			s->pipelining = 0;
+		}
+	}
 
-	if (ssl_open(sock, smtp_server))
-		return -1;
+	if (debug)
+		log_lines("S: ", line, len);
 
-	use_ssl = 1;
+	int n = sizeof(s->reply) - 1 - s->replen;
+	if (n > len)
+		n = len;
+	memcpy(s->reply + s->replen, line, n);
+	s->replen += n;
+	s->reply[s->replen] = 0;
 
-	// We have to send hello again
-	return send_ehlo(sock);
+	s->more = line[3] == '-';
+	return !s->more;
 }
 
-static int smtp_one(const char *fname)
+/* Read what the server has sent and act on any complete replies.
+ * Returns 1 if we got something, 0 if we would block, -1 on error.
+ */
+static int session_input(struct smtp *s)
 {
-	char logout[1024];
-	char buffer[1024];
-	FILE *fp;
-	int rc;
+	int got = 0;
 
-	strlcpy(logout, fname, sizeof(logout));
+	while (s->state != S_IDLE) {
+		if (s->rpos) {
+			s->rlen -= s->rpos;
+			memmove(s->rbuf, s->rbuf + s->rpos, s->rlen);
+			s->rpos = 0;
+		}
+		if (s->rlen == sizeof(s->rbuf)) {
+			logmsg("Reply line too long");
+			return -1;
+		}
 
-	rc = open_spool_file(fname, &fp);
-	if (rc) {
-		logmsg("open %s: %s", fname, strerror(errno));
-		return rc;
+		int want = sizeof(s->rbuf) - s->rlen;
+		int n = read_socket(s, s->rbuf + s->rlen, want);
+		if (n == 0) {
+			logmsg("Connection closed");
+			return -1;
+		}
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+				return got;
+			logmsg("read: %s", strerror(errno));
+			return -1;
+		}
+		s->rlen += n;
+		got = 1;
+
+		char *e;
+		while (s->state != S_IDLE &&
+			   (e = memchr(s->rbuf + s->rpos, '\n', s->rlen - s->rpos))) {
+			char *line = s->rbuf + s->rpos;
+			int len = e - line + 1;
+			s->rpos += len;
+
+			int done = reply_line(s, line, len);
+			if (done < 0)
+				return -1;
+			if (done && on_reply(s))
+				return -1;
+		}
+
+		// A short read on a plain socket means it is empty, don't
+		// spend a syscall finding that out
+		if (!s->ssl && n < want)
+			break;
+	}
+
+	return got;
+}
+
+/* Write out as much as we can, refilling from the spool file when
+ * sending the body. Returns 1 if we sent something, 0 if we would
+ * block, -1 on error.
+ */
+static int session_output(struct smtp *s)
+{
+	int sent = 0;
+
+	while (s->state != S_IDLE) {
+		if (s->opos == s->olen) {
+			s->opos = s->olen = 0;
+			if (s->state != S_BODY)
+				break;
+			if (s->zerocopy || (s->zerocopy = body_zerocopy(s))) {
+				int n = body_sendfile(s);
+				if (n < 0)
+					return -1;
+				if (n == 0)
+					break;
+				metric_add(M_BYTES, n);
+				sent = 1;
+				continue;
+			}
+			if (body_fill(s) < 0)
+				return -1;
+		}
+
+		int n = write_socket(s, s->obuf + s->opos, s->olen - s->opos);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+				break;
+			logmsg("write: %s", strerror(errno));
+			return -1;
+		}
+		s->opos += n;
+		metric_add(M_BYTES, n);
+		sent = 1;
+
+		// Only push out a partial TLS record when we are about to
+		// wait for a reply. The body fills full size records.
+		if (s->ssl && s->opos == s->olen && s->state != S_BODY)
+			ssl_flush(s->ssl);
 	}
 
-	rc = -1; // reset to failed
+	return sent;
+}
+
+/* Drive the session as far as it will go without blocking */
+static void session_step(struct smtp *s)
+{
+	while (s->state != S_IDLE && s->state != S_CONNECT) {
+		int n, moved = 0;
+
+		if (s->ssl) {
+			s->want = ssl_pump(s->ssl);
+			if (s->want < 0)
+				goto failed;
+
+			if (s->state == S_HANDSHAKE) {
+				if (!ssl_ready(s->ssl))
+					break;
+				metrics_time(H_HANDSHAKE, now_ms() - s->since);
+				if (debug)
+					logmsg("TLS sessions: %llu resumed %llu new%s",
+						   metrics[M_TLS_RESUMED], metrics[M_TLS_FULL],
+						   ssl_ktls(s->ssl) ? " (kTLS)" : "");
+				// smtps waits for the greeting, starttls says hello again
+				if (s->srv->starttls)
+					send_ehlo(s);
+				else
+					set_state(s, S_GREETING);
+			}
+		}
+
+		n = session_output(s);
+		if (n < 0)
+			goto failed;
+		moved |= n;
+
+		if (s->ssl) {
+			s->want = ssl_pump(s->ssl);
+			if (s->want < 0)
+				goto failed;
+		}
+
+		n = session_input(s);
+		if (n < 0)
+			goto failed;
+		moved |= n;
 
-	int sock = open_and_connect();
-	if (sock == -1) {
-		goto done;
+		if (!moved)
+			break;
+		if (s->state == S_BODY)
+			set_deadline(s, S_BODY);
 	}
 
-	if (starttls) {
-		if (start_starttls(sock))
-			goto done;
-	} else {
-		expect_status(sock, 220);
+	return;
+
+failed:
+	session_fail(s);
+}
 
-		if (send_ehlo(sock))
-			goto done;
+static short session_events(struct smtp *s)
+{
+	switch (s->state) {
+	case S_IDLE:
+		return 0;
+	case S_BODY:
+		return POLLOUT | (s->ssl ? s->want : POLLIN);
 	}
 
-	if (smtp_user)
-		auth_user(sock, buffer, sizeof(buffer));
+	short events = s->ssl ? s->want : POLLIN;
+	if (s->opos < s->olen)
+		events |= POLLOUT;
+	return events;
+}
 
-	strconcat(buffer, sizeof(buffer), "MAIL FROM:<", mail_from, ">\r\n", NULL);
-	if (send_str(sock, buffer, 250))
-		goto done;
-
-	char line[128], *p;
-	int first_time = 1;
-	int count = 0;
-	while (fgets(line, sizeof(line), fp) && *line != '\n') {
-		strtok(line, "\r\n");
-		p = strchr(line, '@');
-		if (p) {
-			strlcat(logout, " ", sizeof(logout));
-			strlcat(logout, line, sizeof(logout));
-			strconcat(buffer, sizeof(buffer), "RCPT TO:<", line, ">\r\n", NULL);
-		} else {
-			if (first_time) {
-				first_time = 0;
-				strlcat(logout, " ", sizeof(logout));
-				strlcat(logout, mail_from, sizeof(logout));
-				strconcat(buffer, sizeof(buffer), "RCPT TO:<", mail_from, ">\r\n", NULL);
-			} else
+/* Start the latency clock for a message we just got */
+static void msg_picked(struct smtp *s, long long now)
+{
+	long long stamp = queue_stamp(s->fname);
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	s->picked = now;
+	s->queued = stamp ? (ts.tv_sec * 1000000LL + ts.tv_nsec / 1000 - stamp) / 1000 : -1;
+
+	// Charged once, even if a reconnect starts it over
+	struct stat sbuf;
+	if (s->srv->max_bytes && stat(s->fname, &sbuf) == 0)
+		s->srv->bytes -= sbuf.st_size;
+}
+
+/* Hand out the queued files to the sessions */
+static void dispatch(void)
+{
+	long long now = now_ms();
+	int i;
+
+	for (i = 0; i < workers; ++i) {
+		struct smtp *s = &sessions[i];
+
+		if (s->state == S_READY && !s->fname) {
+			if (stopping || (max_messages && s->sent >= max_messages) ||
+				queue_due() < 0 || queue_due() > now ||
+				server_active(s->srv) > (int)s->srv->limit) {
+				smtp_quit(s);
+				continue;
+			}
+			// Hang on to the session until the rate limit allows,
+			// unless that is longer than it may sit idle
+			if (!server_take(s->srv, now)) {
+				if (now + server_wait(s->srv, now) >= s->deadline)
+					smtp_quit(s);
 				continue;
+			}
+			s->fname = queue_next(now);
+			msg_picked(s, now);
+		}
+
+		if (s->state == S_READY && s->fname) {
+			if (msg_start(s))
+				session_fail(s);
+		} else if (s->state == S_IDLE && !s->fname && !stopping &&
+				   queue_due() >= 0 && queue_due() <= now &&
+				   (s->srv = server_pick(now))) {
+			s->fname = queue_next(now);
+			msg_picked(s, now);
+			if (session_connect(s)) {
+				server_failed(s->srv);
+				msg_done(s, 1);
+			}
 		}
-		int n = send_str(sock, buffer, 250);
-		if (n == 0)
-			++count;
-		else if (n < 0)
-			goto done;
-		else
-			strlcat(logout, "(X)", sizeof(logout));
 	}
+}
 
-	send_str(sock, "DATA\r\n", 354);
+/* Shorten the poll() timeout so we wake up at when */
+static void wake_at(int *timeout, long long when, long long now)
+{
+	long long n = when > now ? when - now : 0;
 
-	send_body(sock, fp);
+	if (n < INT_MAX && (*timeout < 0 || n < *timeout))
+		*timeout = n;
+}
 
-	send_str(sock, "QUIT\r\n", 221);
+static int sessions_idle(void)
+{
+	int i;
 
-	logmsg("%s", logout);
+	for (i = 0; i < workers; ++i)
+		if (sessions[i].state != S_IDLE)
+			return 0;
 
-	rc = 0; // success
+	return 1;
+}
 
-done:
-	fclose(fp);
-	ssl_close();
-	if (sock != -1)
-		close(sock);
-	return rc;
+static void set_timeout(const char *name, int secs)
+{
+	int i;
+
+	for (i = 0; i < T_MAX; ++i)
+		if (timeouts[i].name && strcmp(timeouts[i].name, name) == 0) {
+			if (secs <= 0) {
+				logmsg("timeout-%s must be at least 1", name);
+				exit(1);
+			}
+			timeouts[i].secs = secs;
+			return;
+		}
+
+	logmsg("Unexpected key timeout-%s", name);
 }
 
 #define NEED_VAL do {							\
@@ -453,6 +1647,85 @@ done:
 		}										\
 	} while (0)
 
+/* Fill in the server from the defaults and split up the url */
+static void server_config(struct server *srv)
+{
+	if (!srv->user) {
+		srv->user = defaults.user;
+		srv->passwd = defaults.passwd;
+	}
+	if (srv->user && !srv->passwd) {
+		logmsg("%s: You must set smtp-user AND smtp-password", srv->host);
+		exit(1);
+	}
+	srv->starttls |= defaults.starttls;
+	if (!srv->weight)
+		srv->weight = defaults.weight;
+	if (!srv->max_rate)
+		srv->max_rate = defaults.max_rate;
+	if (!srv->max_bytes)
+		srv->max_bytes = defaults.max_bytes;
+
+	// Start with one session and a full second of tokens
+	srv->limit = 1;
+	srv->ssthresh = workers;
+	srv->msgs = srv->max_rate > 60 ? srv->max_rate / 60.0 : 1;
+	srv->bytes = srv->max_bytes / 60.0;
+
+	srv->port = 25;
+	char *host = strstr(srv->host, "://");
+	if (host) {
+		host += 3;
+		if (strncmp(srv->host, "smtps", 5) == 0) {
+#ifndef WANT_SSL
+			logmsg("smtps not supported");
+			exit(1);
+#endif
+			srv->port = 465;
+			srv->use_ssl = 1;
+			if (debug)
+				logmsg("Using SSL for %s", host);
+		}
+		srv->host = host;
+	}
+
+	// host:port or [v6]:port
+	char *end = srv->host;
+	if (*end == '[') {
+		end = strchr(end, ']');
+		if (!end) {
+			logmsg("%s: missing ]", srv->host);
+			exit(1);
+		}
+		++srv->host;
+		*end++ = 0;
+	} else if (strchr(end, ':') != strrchr(end, ':'))
+		return; // a bare IPv6 address
+	else
+		end = strchr(end, ':');
+	if (end && *end == ':') {
+		*end++ = 0;
+		long port = strtol(end, NULL, 10);
+		if (port < 1 || port > 65535) {
+			logmsg("%s: bad port %s", srv->host, end);
+			exit(1);
+		}
+		srv->port = port;
+	}
+}
+
+#ifdef WANT_SSL
+/* The user we will be running as once privileges are dropped */
+static uid_t run_uid(void)
+{
+	if (no_change)
+		return getuid();
+
+	struct passwd *pw = getpwnam(DOORKNOBUSER);
+	return pw ? pw->pw_uid : (uid_t)-1;
+}
+#endif
+
 static void read_config(void)
 {
 	FILE *fp = fopen(CONFIGFILE, "r");
@@ -461,7 +1734,10 @@ static void read_config(void)
 		exit(1);
 	}
 
+	struct server *srv = &defaults;
 	char line[128];
+	int i;
+
 	while (fgets(line, sizeof(line), fp)) {
 		if (!strrchr(line, '\n')) {
 			logmsg("Config file line to long");
@@ -475,13 +1751,37 @@ static void read_config(void)
 			continue; // empty line
 		if (strcmp(key, "smtp-server") == 0) {
 			NEED_VAL;
-			smtp_server = must_strdup(val);
+			if (nservers == MAX_SERVERS) {
+				logmsg("Too many smtp-servers, max %d", MAX_SERVERS);
+				exit(1);
+			}
+			srv = &servers[nservers++];
+			srv->host = must_strdup(val);
 		} else if (strcmp(key, "smtp-user") == 0) {
 			NEED_VAL;
-			smtp_user = must_strdup(val);
+			srv->user = must_strdup(val);
 		} else if (strcmp(key, "smtp-password") == 0) {
 			NEED_VAL;
-			smtp_passwd = must_strdup(val);
+			srv->passwd = must_strdup(val);
+		} else if (strcmp(key, "weight") == 0) {
+			NEED_VAL;
+			srv->weight = strtol(val, NULL, 0);
+			if (srv->weight < 1) {
+				logmsg("weight must be at least 1");
+				exit(1);
+			}
+		} else if (strcmp(key, "max-rate") == 0) {
+			NEED_VAL;
+			srv->max_rate = strtol(val, NULL, 0);
+		} else if (strcmp(key, "max-bytes") == 0) {
+			NEED_VAL;
+			srv->max_bytes = strtol(val, NULL, 0);
+		} else if (strcmp(key, "eject-after") == 0) {
+			NEED_VAL;
+			eject_after = strtol(val, NULL, 0);
+		} else if (strcmp(key, "eject-time") == 0) {
+			NEED_VAL;
+			eject_time = strtol(val, NULL, 0);
 		} else if (strcmp(key, "mail-from") == 0) {
 			NEED_VAL;
 			mail_from = must_strdup(val);
@@ -490,9 +1790,41 @@ static void read_config(void)
 			logmsg("starttls not supported");
 			exit(1);
 #endif
-			starttls = 1;
+			srv->starttls = 1;
 		} else if (strcmp(key, "rewrite-from") == 0)
 			rewrite_from = 1;
+		else if (strcmp(key, "max-messages") == 0) {
+			NEED_VAL;
+			max_messages = strtol(val, NULL, 0);
+		} else if (strcmp(key, "workers") == 0) {
+			NEED_VAL;
+			workers = strtol(val, NULL, 0);
+			if (workers < 1 || workers > MAX_WORKERS) {
+				logmsg("workers must be 1 to %d", MAX_WORKERS);
+				exit(1);
+			}
+		} else if (strncmp(key, "timeout-", 8) == 0) {
+			NEED_VAL;
+			set_timeout(key + 8, strtol(val, NULL, 0));
+		} else if (strcmp(key, "log-format") == 0) {
+			NEED_VAL;
+			if (strcmp(val, "kv") == 0)
+				log_set_format(LOG_KV);
+			else if (strcmp(val, "plain") == 0)
+				log_set_format(LOG_PLAIN);
+			else {
+				logmsg("log-format must be plain or kv");
+				exit(1);
+			}
+		} else if (strcmp(key, "hashed-queue") == 0)
+			hashed_queue = 1;
+		else if (strcmp(key, "retry-min") == 0) {
+			NEED_VAL;
+			retry_min = strtol(val, NULL, 0);
+		} else if (strcmp(key, "retry-max") == 0) {
+			NEED_VAL;
+			retry_max = strtol(val, NULL, 0);
+		}
 		else if (strcmp(key, "cert") == 0) {
 #ifdef WANT_SSL
 			NEED_VAL;
@@ -500,6 +1832,14 @@ static void read_config(void)
 				logmsg("Bad cert file %s", val);
 				exit(1);
 			}
+#endif
+		} else if (strcmp(key, "tls-session-cache") == 0) {
+#ifdef WANT_SSL
+			NEED_VAL;
+			if (ssl_session_cache(val, run_uid())) {
+				logmsg("%s: %s", val, strerror(errno));
+				exit(1);
+			}
 #endif
 		} else
 			logmsg("Unexpected key %s", key);
@@ -507,7 +1847,7 @@ static void read_config(void)
 
 	fclose(fp);
 
-	if (!smtp_server) {
+	if (nservers == 0) {
 		logmsg("You must set smtp-server");
 		exit(1);
 	}
@@ -516,26 +1856,18 @@ static void read_config(void)
 		logmsg("You must set mail-from");
 		exit(1);
 	}
-	if (smtp_user && !smtp_passwd) {
-		logmsg("You must set smtp-user AND smtp-password");
+	if (eject_after < 1 || eject_time < 1) {
+		logmsg("eject-after and eject-time must be at least 1");
 		exit(1);
 	}
-
-	char *server = strstr(smtp_server, "://");
-	if (server) {
-		server += 3;
-		if (strncmp(smtp_server, "smtps", 5) == 0) {
-#ifndef WANT_SSL
-			logmsg("smtps not supported");
-			exit(1);
-#endif
-			smtp_port = 465;
-			use_ssl = 1;
-			if (debug)
-				puts("Using SSL");
-		}
-		smtp_server = server;
+	if (retry_min < 1 || retry_max < retry_min) {
+		logmsg("retry-min must be at least 1 and no more than retry-max");
+		exit(1);
 	}
+	queue_set_retry(retry_min, retry_max);
+
+	for (i = 0; i < nservers; ++i)
+		server_config(&servers[i]);
 
 	if (gethostname(hostname, sizeof(hostname))) {
 		logmsg("hostname: %s", strerror(errno));
@@ -543,39 +1875,47 @@ static void read_config(void)
 	}
 }
 
-static void get_smtp_server(void)
+/* Add the new files to the queue. Returns non-zero if events were
+ * lost and the queue needs a rescan.
+ */
+static int read_event(int fd)
 {
-	int first_time = 1;
-
-	struct hostent *host;
-	do {
-		host = gethostbyname(smtp_server);
-		if (!host) {
-			if (first_time) {
-				logmsg("Warning: Unable to get host %s", smtp_server);
-				first_time = 0;
-			}
-			sleep(5);
-		}
-	} while (!host);
+	uint8_t buf[16 * (sizeof(struct inotify_event) + NAME_MAX + 1)]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+	int overflow = 0;
+	long long now = now_ms();
+
+	int n = read(fd, buf, sizeof(buf));
+	for (uint8_t *p = buf; p < buf + n; ) {
+		struct inotify_event *event = (struct inotify_event *)p;
+		if (event->mask & IN_Q_OVERFLOW)
+			overflow = 1;
+		else if (event->len)
+			queue_notify(event->wd, event->name, now);
+		p += sizeof(struct inotify_event) + event->len;
+	}
 
-	smtp_addr = *(uint32_t *)host->h_addr_list[0];
+	return overflow;
 }
 
-// This is really to get around the read() return warning.
-// The event is just a trigger, we don't care what it says.
-static int read_event(int fd)
+/* Signals are passed to the main loop through a pipe */
+static int sig_fds[2];
+
+static void sig_handler(int sig)
 {
-	uint8_t event[sizeof(struct inotify_event) + NAME_MAX + 1];
-	return read(fd, event, sizeof(event));
+	char c = sig;
+	int rc = write(sig_fds[1], &c, 1);
+	(void)rc;
 }
 
 static void _usage(void)
 {
-	puts("usage: doorknob [-fds]\n"
+	puts("usage: doorknob [-fdlms]\n"
 		 "where: -d turns on debugging (enables foreground and stderr)\n"
 		 "       -f keeps doorknob in foreground\n"
 		 "       -h this help message\n"
+		 "       -l print the delivery latency percentiles\n"
+		 "       -m print the metrics from the running doorknob\n"
 		 "       -s use stderr rather than syslog\n"
 		 "\n"
 		 "Note: You must have an " CONFIGFILE " configured for your system.\n"
@@ -585,11 +1925,11 @@ static void _usage(void)
 
 int main(int argc, char *argv[])
 {
-	int c, no_change = 0;
+	int c;
 
-	logging_init();
+	log_open();
 
-	while ((c = getopt(argc, argv, "CDFdfhs")) != EOF)
+	while ((c = getopt(argc, argv, "CDFdfhlms")) != EOF)
 		switch (c) {
 		case 'C':
 			no_change = 1;
@@ -598,7 +1938,7 @@ int main(int argc, char *argv[])
 		case 'd':
 			++debug;
 			foreground = 1;
-			use_stderr = 1;
+			log_to_stderr();
 			break;
 		case 'F': // for backwards compatibility
 		case 'f':
@@ -606,8 +1946,12 @@ int main(int argc, char *argv[])
 			break;
 		case 'h':
 			_usage();
+		case 'l':
+			return metrics_dump(METRICS_SOCKET, 1);
+		case 'm':
+			return metrics_dump(METRICS_SOCKET, 0);
 		case 's':
-			use_stderr = 1;
+			log_to_stderr();
 			break;
 		default:
 			puts("Sorry! Maybe try -h for help?");
@@ -619,25 +1963,34 @@ int main(int argc, char *argv[])
 		exit(1);
 	}
 
-	DIR *dir = opendir(".");
-	if (!dir) {
-		logmsg("opendir: %s", strerror(errno));
-		exit(1);
-	}
-
 	int fd = inotify_init();
 	if (fd < 0) {
 		logmsg("inotify_init: %s", strerror(errno));
 		exit(1);
 	}
 
-	int watch = inotify_add_watch(fd, ".", IN_CLOSE_WRITE | IN_MOVED_TO);
-	if (watch < 0) {
-		logmsg("inotify_add_watch: %s", strerror(errno));
+	read_config();
+
+	queue_watch(fd, hashed_queue);
+
+	// Before dropping privileges in case the old socket is root's
+	int mfd = metrics_open(METRICS_SOCKET);
+
+	if (pipe(sig_fds)) {
+		logmsg("pipe: %s", strerror(errno));
 		exit(1);
 	}
-
-	read_config();
+	fcntl(sig_fds[0], F_SETFL, O_NONBLOCK);
+	fcntl(sig_fds[1], F_SETFL, O_NONBLOCK);
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sig_handler;
+	sa.sa_flags = SA_RESTART;
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGHUP, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
 
 	/* Do this after inotify setup and reading config */
 	if (no_change == 0) {
@@ -659,6 +2012,7 @@ int main(int argc, char *argv[])
 	}
 
 	if (foreground == 0) {
+		log_flush(); // not twice, once from each side of the fork
 #ifdef __QNX__
 		// daemon call causes slog2 to stop working
 		if (procmgr_daemon(0, PROCMGR_DAEMON_NOCLOSE | PROCMGR_DAEMON_NOCHDIR))
@@ -669,34 +2023,138 @@ int main(int argc, char *argv[])
 #endif
 	}
 
-	// Get the smtp server after possibly going into background.
-	// This is to deal with the case where, for example, you need to
-	// startup a VPN for DNS to work. We don't want to stay in the
-	// foreground while waiting.
-	get_smtp_server();
+	srandom(time(NULL) ^ getpid()); // retry jitter and dns ids
+
+	// Look up the smtp server after possibly going into
+	// background. Delivery starts once it resolves.
+	for (c = 0; c < nservers; ++c)
+		servers[c].dns = dns_open(servers[c].host, servers[c].port, now_ms());
 
 	logmsg("Running");
 
-	struct pollfd ufd = { .fd = fd, .events = POLLIN };
+	for (c = 0; c < MAX_WORKERS; ++c)
+		sessions[c].sock = -1;
+
+	int rescan = 1;
 
 	while (1) {
-		struct dirent *ent;
-		int timeout = 3600000; // one hour
-
-		rewinddir(dir);
-		while ((ent = readdir(dir)))
-			if (*ent->d_name != '.') {
-				if (smtp_one(ent->d_name) >= 0) {
-					if (unlink(ent->d_name))
-						logmsg("unlink %s: %s", strerror(errno));
-				} else
-					// More aggressive timeout if smtp_one failed
-					timeout = 60000; // one minute
+		struct pollfd fds[MAX_WORKERS * MAX_ATTEMPTS + MAX_SERVERS + 3];
+		int slot[MAX_WORKERS];
+		long long now = now_ms();
+		int i, n, nfds, timeout;
+
+		if (rescan && !stopping) {
+			rescan = 0;
+			queue_scan(now);
+		}
+
+		dispatch();
+
+		if (stopping && sessions_idle())
+			break;
+
+		fds[0].fd = fd;
+		fds[0].events = POLLIN;
+		fds[1].fd = sig_fds[0];
+		fds[1].events = POLLIN;
+		fds[2].fd = mfd; // -1 is ignored
+		fds[2].events = POLLIN;
+		nfds = 3;
+
+		timeout = -1;
+		for (i = 0; i < nservers; ++i) {
+			fds[nfds].fd = dns_fd(servers[i].dns); // -1 is ignored
+			fds[nfds].events = POLLIN;
+			++nfds;
+			wake_at(&timeout, dns_deadline(servers[i].dns), now);
+		}
+
+		int idle = 0;
+		for (i = 0; i < workers; ++i) {
+			struct smtp *s = &sessions[i];
+			slot[i] = -1;
+			if (s->state == S_IDLE) {
+				++idle;
+				continue;
 			}
+			if (s->state == S_READY && !s->fname) {
+				// Waiting on the rate limit
+				wake_at(&timeout, now + server_wait(s->srv, now), now);
+			}
+			slot[i] = nfds;
+			long long deadline = s->deadline;
+			if (s->state == S_CONNECT) {
+				// Attempts that are over have sock -1 which poll() skips
+				for (n = 0; n < s->nattempts; ++n) {
+					fds[nfds].fd = s->attempt[n].sock;
+					fds[nfds].events = POLLOUT;
+					++nfds;
+				}
+				if (s->next_attempt < deadline)
+					deadline = s->next_attempt;
+			} else {
+				fds[nfds].fd = s->sock;
+				fds[nfds].events = session_events(s);
+				++nfds;
+			}
+			wake_at(&timeout, deadline, now);
+		}
+
+		// Wake up for the next retry if there is a session and a server
+		// to take it
+		long long due = stopping ? -1 : queue_due();
+		long long ready = server_ready(now);
+		if (idle && due >= 0 && ready >= 0)
+			wake_at(&timeout, due > ready ? due : ready, now);
+
+		// Write out what this pass logged before going to sleep
+		log_flush();
+
+		n = poll(fds, nfds, timeout);
+		if (n < 0 && errno != EINTR) {
+			logmsg("poll: %s", strerror(errno));
+			exit(1);
+		}
 
-		if (poll(&ufd, 1, timeout) == 1)
-			read_event(fd);
+		if (n > 0 && (fds[0].revents & POLLIN))
+			if (read_event(fd))
+				rescan = 1;
+
+		if (n > 0 && (fds[2].revents & POLLIN))
+			metrics_serve(mfd, workers - idle);
+
+		if (n > 0 && (fds[1].revents & POLLIN)) {
+			char sigs[16];
+			n = read(sig_fds[0], sigs, sizeof(sigs));
+			for (i = 0; i < n; ++i)
+				if (sigs[i] == SIGHUP)
+					rescan = 1;
+				else if (!stopping) {
+					logmsg("Stopping");
+					stopping = 1;
+				}
+		}
+
+		now = now_ms();
+		for (i = 0; i < nservers; ++i)
+			dns_step(servers[i].dns, now);
+
+		for (i = 0; i < workers; ++i) {
+			struct smtp *s = &sessions[i];
+			if (slot[i] < 0 || s->state == S_IDLE)
+				continue;
+			if (s->state == S_CONNECT)
+				connect_step(s, &fds[slot[i]], now);
+			else if (fds[slot[i]].revents)
+				session_step(s);
+			else if (now >= s->deadline) {
+				logmsg("Timeout waiting for %s", timeouts[s->waiting].name);
+				session_fail(s);
+			}
+		}
 	}
 
+	logmsg("Stopped");
+
 	return 0;
 }
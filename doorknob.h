@@ -1,5 +1,8 @@
+#include <stdio.h>
 #include <stdint.h>
+#include <limits.h>
 #include <string.h>
+#include <sys/types.h>
 
 #ifndef HOST_NAME_MAX
 #define HOST_NAME_MAX 64
@@ -9,15 +12,110 @@
 #define NAME_MAX 255
 #endif
 
-/* Exported from doorknob.c */
+/* The longest recipient line in a queue file, newline and NUL
+ * included. RFC 5321 allows 256 for a path.
+ */
+#define MAX_ADDR 258
+
+/* The queue is either flat, queue/<name>, or hashed into 256
+ * subdirectories, queue/ab/<name>, which scales better for very large
+ * queues. It is hashed once the QUEUE_HASHED marker file exists in
+ * the queue directory. Shared by doorknob, sendmail and mailq.
+ */
+#define QUEUE_HASHED ".hashed"
+#define QUEUE_DIRS 256
+
+static inline unsigned queue_hash(const char *name)
+{
+	unsigned h = 2166136261u; // FNV-1a
+
+	while (*name)
+		h = (h ^ (unsigned char)*name++) * 16777619u;
+	return h;
+}
+
+/* The path of name relative to the queue directory */
+static inline void queue_path(char *path, int len, const char *name, int hashed)
+{
+	if (hashed)
+		snprintf(path, len, "%02x/%s", queue_hash(name) % QUEUE_DIRS, name);
+	else
+		snprintf(path, len, "%s", name);
+}
+
+/* Exported from log.c */
+#define LOG_PLAIN 0
+#define LOG_KV    1
+
+void log_open(void);
+void log_to_stderr(void);
+void log_set_format(int fmt);
 void logmsg(const char *fmt, ...);
+void log_lines(const char *prefix, const char *data, int len);
+void log_flush(void);
 
 /* Exported from bear.c */
-int ssl_open(int sock, const char *host);
-int ssl_read(char *buffer, int len);
-int ssl_write(const char *buffer, int len);
-void ssl_close(void);
+struct ssl_conn;
+struct ssl_conn *ssl_open(int sock, const char *host);
+int ssl_pump(struct ssl_conn *ssl);
+int ssl_ready(struct ssl_conn *ssl);
+int ssl_ktls(struct ssl_conn *ssl);
+int ssl_read(struct ssl_conn *ssl, char *buffer, int len);
+int ssl_write(struct ssl_conn *ssl, const char *buffer, int len);
+void ssl_flush(struct ssl_conn *ssl);
+void ssl_close(struct ssl_conn *ssl);
 int ssl_read_cert(const char *fname);
+int ssl_session_cache(const char *fname, uid_t owner);
+
+/* Exported from dns.c */
+struct dns_host;
+struct sockaddr;
+struct dns_host *dns_open(const char *name, int port, long long now);
+int dns_fd(struct dns_host *h);
+long long dns_deadline(struct dns_host *h);
+void dns_step(struct dns_host *h, long long now);
+int dns_count(struct dns_host *h);
+const struct sockaddr *dns_addr(struct dns_host *h, int n, unsigned *len);
+void dns_report(struct dns_host *h, const struct sockaddr *sa, int ms);
+
+/* Exported from metrics.c */
+enum {
+	M_DELIVERED, M_DEFERRED, M_BOUNCED, M_BYTES, M_CONNECTS, M_FAILURES,
+	M_TLS_RESUMED, M_TLS_FULL, M_MAX
+};
+enum { H_CONNECT, H_HANDSHAKE, H_AUTH, H_DATA, H_MAX };
+enum { L_QUEUE, L_DELIVERY, L_TOTAL, L_MAX };
+
+extern unsigned long long metrics[M_MAX];
+
+/* Cheap enough for the delivery path, and safe if anything ever
+ * reads them from another thread.
+ */
+static inline void metric_inc(unsigned long long *m, unsigned long long n)
+{
+	__atomic_fetch_add(m, n, __ATOMIC_RELAXED);
+}
+#define metric_add(m, n) metric_inc(&metrics[m], n)
+
+void metrics_time(int h, long long ms);
+void metrics_reply(int status);
+void metrics_latency(long long queued, long long delivery);
+int metrics_open(const char *path);
+void metrics_serve(int fd, int sessions);
+int metrics_dump(const char *path, int latency);
+
+/* Exported from queue.c */
+void queue_watch(int fd, int hashed);
+void queue_notify(int wd, const char *name, long long now);
+void queue_scan(long long now);
+char *queue_next(long long now);
+long long queue_due(void);
+void queue_done(const char *name);
+void queue_set_retry(int min, int max);
+void queue_retry(const char *name, long long now);
+long long queue_stamp(const char *name);
+unsigned queue_count(void);
+long long queue_oldest(void);
 
 /* Exported from utils.c */
 int base64_encode(char *dst, int dlen, const uint8_t *src, int len);
@@ -0,0 +1,180 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <syslog.h>
+
+#include "doorknob.h"
+
+/* Log records are formatted straight into a preallocated buffer and
+ * written out in batches by log_flush(), which the poll loop calls
+ * once a pass and atexit() calls at the end. So a session never waits
+ * on syslog or a slow stderr in the middle of a delivery. A record
+ * that does not fit flushes what is there first, nothing is dropped.
+ */
+#define LOG_BUFFER 65536
+#define LOG_RECORD 4096 // longer records are cut
+
+static char buffer[LOG_BUFFER];
+static int used;
+
+static int to_stderr;
+static int format = LOG_PLAIN;
+
+#ifdef __QNX__
+#include <sys/slog2.h>
+
+void log_open(void)
+{
+	slog2_buffer_t buffer_handle;
+	slog2_buffer_set_config_t buffer_config = {
+		.num_buffers = 1,
+		.buffer_set_name = "doorknob",
+		.verbosity_level = SLOG2_INFO,
+		.buffer_config[0].buffer_name = "doorknob",
+		.buffer_config[0].num_pages = 1,
+	};
+
+	if (slog2_register(&buffer_config, &buffer_handle, 0)) {
+		fprintf(stderr, "Error registering slog2 buffer!\n");
+		exit(1);
+	}
+
+	slog2_set_default_buffer(buffer_handle);
+	atexit(log_flush);
+}
+
+static void sys_log(const char *msg)
+{
+	slog2c(NULL, 0, SLOG2_INFO, msg);
+}
+#else
+void log_open(void)
+{
+	openlog("doorknob", 0, LOG_MAIL);
+	atexit(log_flush);
+}
+
+static void sys_log(const char *msg)
+{
+	syslog(LOG_INFO, "%s", msg);
+}
+#endif
+
+void log_to_stderr(void)
+{
+	to_stderr = 1;
+}
+
+void log_set_format(int fmt)
+{
+	format = fmt;
+}
+
+/* Quote a message for the key=value format */
+static int quote(char *out, int len, const char *msg)
+{
+	int n = 0;
+
+	out[n++] = '"';
+	for (; *msg && n < len - 3; ++msg) {
+		if (*msg == '"' || *msg == '\\')
+			out[n++] = '\\';
+		else if (*msg == '\n' || *msg == '\r')
+			continue;
+		out[n++] = *msg;
+	}
+	out[n++] = '"';
+	out[n] = 0;
+	return n;
+}
+
+/* log_flush() splits the buffer on newlines, so a record must not
+ * contain any. Server replies often end in one.
+ */
+static int one_line(char *rec, int n)
+{
+	while (n > 0 && (rec[n - 1] == '\n' || rec[n - 1] == '\r'))
+		--n;
+	for (int i = 0; i < n; ++i)
+		if (rec[i] == '\n' || rec[i] == '\r')
+			rec[i] = ' ';
+	return n;
+}
+
+void logmsg(const char *fmt, ...)
+{
+	static char msg[LOG_RECORD];
+	va_list ap;
+	int n;
+
+	if (LOG_BUFFER - used < LOG_RECORD)
+		log_flush();
+
+	char *rec = buffer + used;
+
+	va_start(ap, fmt);
+	if (format == LOG_KV) {
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+
+		vsnprintf(msg, sizeof(msg), fmt, ap);
+		n = snprintf(rec, LOG_RECORD, "ts=%lld.%03ld msg=",
+					 (long long)ts.tv_sec, ts.tv_nsec / 1000000);
+		n += quote(rec + n, LOG_RECORD - n, msg);
+	} else {
+		n = vsnprintf(rec, LOG_RECORD, fmt, ap);
+		if (n > LOG_RECORD - 2)
+			n = LOG_RECORD - 2;
+		n = one_line(rec, n);
+	}
+	va_end(ap);
+
+	rec[n++] = '\n';
+	used += n;
+}
+
+/* A record for each line of data, for the -d protocol traces. They
+ * go through the buffer so they stay in order with everything else.
+ */
+void log_lines(const char *prefix, const char *data, int len)
+{
+	while (len > 0) {
+		const char *nl = memchr(data, '\n', len);
+		int n = nl ? nl + 1 - data : len;
+
+		logmsg("%s%.*s", prefix, n, data);
+		data += n;
+		len -= n;
+	}
+}
+
+/* Write out everything logged since the last flush */
+void log_flush(void)
+{
+	char *p = buffer, *end = buffer + used;
+
+	if (used == 0)
+		return;
+
+	if (to_stderr)
+		while (p < end) {
+			int n = write(2, p, end - p);
+			if (n <= 0 && errno != EINTR)
+				break; // nowhere to put it
+			if (n > 0)
+				p += n;
+		}
+	else
+		while (p < end) {
+			char *nl = memchr(p, '\n', end - p);
+			*nl = 0;
+			sys_log(p);
+			p = nl + 1;
+		}
+
+	used = 0;
+}
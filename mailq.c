@@ -5,31 +5,51 @@
 #include <errno.h>
 #include <dirent.h>
 
-#define QDIR MAILDIR"/queue"
+#include "doorknob.h"
 
+#define QDIR MAILDIR"/queue"
 
-int main(int argc, char *argv[])
+static void list(const char *dname, int hashed)
 {
-	if (chdir(QDIR)) {
-		perror("chdir " QDIR);
-		exit(1);
-	}
-
-	DIR *dir = opendir(".");
+	DIR *dir = opendir(dname);
 	if (!dir) {
-		perror("opendir " QDIR);
+		fprintf(stderr, "opendir " QDIR "/%s: %s\n", dname, strerror(errno));
 		exit(1);
 	}
 
 	struct dirent *ent;
 	while ((ent = readdir(dir)))
-		if (*ent->d_name != '.')
+		if (*ent->d_name != '.') {
+			// With a hashed queue skip the subdirectories
+			if (hashed && strlen(ent->d_name) == 2)
+				continue;
 			puts(ent->d_name);
+		}
 
 	if (closedir(dir)) {
-		perror("closedir " QDIR);
+		fprintf(stderr, "closedir " QDIR "/%s: %s\n", dname, strerror(errno));
 		exit(1);
 	}
+}
+
+int main(int argc, char *argv[])
+{
+	if (chdir(QDIR)) {
+		perror("chdir " QDIR);
+		exit(1);
+	}
+
+	int hashed = access(QUEUE_HASHED, F_OK) == 0;
+
+	// A hashed queue may still have flat files that need moving
+	list(".", hashed);
+
+	if (hashed)
+		for (int i = 0; i < QUEUE_DIRS; ++i) {
+			char dname[4];
+			snprintf(dname, sizeof(dname), "%02x", i);
+			list(dname, 0);
+		}
 
 	return 0;
 }
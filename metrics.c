@@ -0,0 +1,333 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "doorknob.h"
+
+/* Counters kept by the daemon and handed out in the Prometheus text
+ * format to anyone who connects to the metrics socket. The delivery
+ * code only ever bumps a counter; all the formatting happens when
+ * somebody asks.
+ */
+unsigned long long metrics[M_MAX];
+
+static const char *counter_names[M_MAX][2] = {
+	[M_DELIVERED]   = { "doorknob_messages_delivered_total", "Messages the server accepted" },
+	[M_DEFERRED]    = { "doorknob_messages_deferred_total", "Messages put back for a retry" },
+	[M_BOUNCED]     = { "doorknob_messages_bounced_total", "Messages dropped on a permanent failure" },
+	[M_BYTES]       = { "doorknob_bytes_sent_total", "Bytes written to the smtp servers" },
+	[M_CONNECTS]    = { "doorknob_connects_total", "Connections made" },
+	[M_FAILURES]    = { "doorknob_session_failures_total", "Sessions dropped on an error or timeout" },
+	[M_TLS_RESUMED] = { "doorknob_tls_resumed_total", "TLS handshakes that resumed a cached session" },
+	[M_TLS_FULL]    = { "doorknob_tls_full_handshakes_total", "TLS handshakes that made a new session" },
+};
+
+/* Histogram buckets in ms. Prometheus wants seconds. */
+static const unsigned buckets[] = {
+	1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000, 10000, 30000, 60000
+};
+#define NBUCKETS (sizeof(buckets) / sizeof(buckets[0]))
+
+static struct {
+	const char *name;
+	const char *help;
+	unsigned long long count[NBUCKETS + 1]; // the last is +Inf
+	unsigned long long sum;                  // ms
+} hists[H_MAX] = {
+	[H_CONNECT]   = { "doorknob_connect_seconds", "Time to connect to a server" },
+	[H_HANDSHAKE] = { "doorknob_tls_handshake_seconds", "Time for the TLS handshake" },
+	[H_AUTH]      = { "doorknob_auth_seconds", "Time to log in" },
+	[H_DATA]      = { "doorknob_data_seconds", "Time from DATA to the final reply" },
+};
+
+static unsigned long long replies[600];
+
+/* Enqueue to accept latency, in ms, in log-linear buckets: below 16ms
+ * one per ms, then 16 to each power of two. So a bucket is never off
+ * by more than 1/16th and 40 powers of two is a long time.
+ */
+#define SUB_BITS 4
+#define SUB      (1 << SUB_BITS)
+#define NLAT     (SUB + 40 * SUB)
+
+static const char *stages[L_MAX] = { "queue", "delivery", "total" };
+
+static struct {
+	unsigned long long count[NLAT];
+	unsigned long long n, sum, max;
+} lat[L_MAX];
+
+static int lat_bucket(unsigned long long ms)
+{
+	if (ms < SUB)
+		return ms;
+
+	int shift = 63 - __builtin_clzll(ms) - SUB_BITS;
+	int i = SUB + shift * SUB + (ms >> shift) - SUB;
+	return i < NLAT ? i : NLAT - 1;
+}
+
+/* The largest value that lands in bucket i */
+static unsigned long long lat_value(int i)
+{
+	if (i < SUB)
+		return i;
+
+	int shift = (i - SUB) / SUB;
+	return ((unsigned long long)(SUB + (i - SUB) % SUB + 1) << shift) - 1;
+}
+
+static void lat_add(int l, long long ms)
+{
+	if (ms < 0)
+		ms = 0; // the clock went back
+	metric_inc(&lat[l].count[lat_bucket(ms)], 1);
+	metric_inc(&lat[l].n, 1);
+	metric_inc(&lat[l].sum, ms);
+	if (ms > lat[l].max)
+		lat[l].max = ms;
+}
+
+/* A message was accepted. queued is how long it sat in the queue,
+ * delivery the time from handing it to a session to the final 250.
+ */
+void metrics_latency(long long queued, long long delivery)
+{
+	lat_add(L_QUEUE, queued);
+	lat_add(L_DELIVERY, delivery);
+	lat_add(L_TOTAL, queued + delivery);
+}
+
+static unsigned long long lat_quantile(int l, double q)
+{
+	unsigned long long want = q * lat[l].n + 0.5, seen = 0;
+	int i;
+
+	if (want == 0)
+		want = 1;
+	for (i = 0; i < NLAT; ++i) {
+		seen += lat[l].count[i];
+		if (seen >= want)
+			return lat_value(i) < lat[l].max ? lat_value(i) : lat[l].max;
+	}
+	return lat[l].max;
+}
+
+void metrics_time(int h, long long ms)
+{
+	unsigned i;
+
+	if (ms < 0)
+		ms = 0;
+	for (i = 0; i < NBUCKETS && ms > buckets[i]; ++i)
+		;
+	metric_inc(&hists[h].count[i], 1);
+	metric_inc(&hists[h].sum, ms);
+}
+
+void metrics_reply(int status)
+{
+	if (status >= 100 && status < 600)
+		metric_inc(&replies[status], 1);
+}
+
+/* The socket is made as root, before dropping privileges, so its
+ * directory must not be one that other users can write to or they
+ * could swap the socket for a link. The mode comes from the umask at
+ * bind() rather than a chmod() by name. The socket itself is open to
+ * all, who can reach it is up to the modes of the directories above.
+ */
+int metrics_open(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	char dir[sizeof(addr.sun_path)];
+	struct stat sbuf;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		logmsg("%s: path too long", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	strcpy(dir, path);
+	char *p = strrchr(dir, '/');
+	if (p)
+		*p = 0;
+	else
+		strcpy(dir, ".");
+	if (stat(dir, &sbuf)) {
+		logmsg("%s: %s", dir, strerror(errno));
+		return -1;
+	}
+	if (sbuf.st_mode & (S_IWGRP | S_IWOTH)) {
+		logmsg("%s: writable by others, no metrics", dir);
+		return -1;
+	}
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		logmsg("socket: %s", strerror(errno));
+		return -1;
+	}
+
+	unlink(path);
+	mode_t mask = umask(0111);
+	int rc = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+	umask(mask);
+	if (rc || listen(fd, 8)) {
+		logmsg("%s: %s", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	return fd;
+}
+
+static char out[32768];
+static int outlen;
+
+static void add(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	int n = vsnprintf(out + outlen, sizeof(out) - outlen, fmt, ap);
+	va_end(ap);
+
+	outlen += n;
+	if (outlen > sizeof(out) - 1)
+		outlen = sizeof(out) - 1; // truncated
+}
+
+static void histogram(int h)
+{
+	unsigned long long total = 0;
+	unsigned i;
+
+	add("# HELP %s %s\n# TYPE %s histogram\n", hists[h].name, hists[h].help, hists[h].name);
+	for (i = 0; i < NBUCKETS; ++i) {
+		total += hists[h].count[i];
+		add("%s_bucket{le=\"%g\"} %llu\n", hists[h].name, buckets[i] / 1000.0, total);
+	}
+	total += hists[h].count[NBUCKETS];
+	add("%s_bucket{le=\"+Inf\"} %llu\n", hists[h].name, total);
+	add("%s_sum %g\n%s_count %llu\n", hists[h].name, hists[h].sum / 1000.0, hists[h].name, total);
+}
+
+/* Somebody connected. Write everything and hang up. */
+void metrics_serve(int fd, int sessions)
+{
+	int i, q;
+
+	int client = accept(fd, NULL, NULL);
+	if (client < 0)
+		return;
+
+	outlen = 0;
+
+	for (i = 0; i < M_MAX; ++i) {
+		const char *name = counter_names[i][0];
+		add("# HELP %s %s\n# TYPE %s counter\n%s %llu\n",
+			name, counter_names[i][1], name, name, metrics[i]);
+	}
+
+	add("# HELP doorknob_replies_total Server replies by code\n"
+		"# TYPE doorknob_replies_total counter\n");
+	for (i = 0; i < 600; ++i)
+		if (replies[i])
+			add("doorknob_replies_total{code=\"%d\"} %llu\n", i, replies[i]);
+
+	for (i = 0; i < H_MAX; ++i)
+		histogram(i);
+
+	static const double quantiles[] = { 0.5, 0.99, 0.999 };
+	add("# HELP doorknob_latency_seconds Enqueue to accepted, and its queue and delivery parts\n"
+		"# TYPE doorknob_latency_seconds summary\n");
+	for (i = 0; i < L_MAX; ++i) {
+		for (q = 0; q < 3; ++q)
+			add("doorknob_latency_seconds{stage=\"%s\",quantile=\"%g\"} %g\n", stages[i],
+				quantiles[q], lat[i].n ? lat_quantile(i, quantiles[q]) / 1000.0 : 0);
+		add("doorknob_latency_seconds_sum{stage=\"%s\"} %g\n", stages[i], lat[i].sum / 1000.0);
+		add("doorknob_latency_seconds_count{stage=\"%s\"} %llu\n", stages[i], lat[i].n);
+	}
+
+	long long oldest = queue_oldest();
+	add("# HELP doorknob_queue_messages Messages in the queue\n"
+		"# TYPE doorknob_queue_messages gauge\n"
+		"doorknob_queue_messages %u\n", queue_count());
+	add("# HELP doorknob_queue_oldest_seconds Age of the oldest queued message\n"
+		"# TYPE doorknob_queue_oldest_seconds gauge\n"
+		"doorknob_queue_oldest_seconds %lld\n", oldest ? (long long)time(NULL) - oldest : 0);
+	add("# HELP doorknob_sessions Sessions connected or connecting\n"
+		"# TYPE doorknob_sessions gauge\n"
+		"doorknob_sessions %d\n", sessions);
+
+	// Small enough for the socket buffer, so this does not block
+	if (write(client, out, outlen) != outlen)
+		logmsg("metrics: short write");
+	close(client);
+}
+
+/* doorknob -l: just the latencies, as a table */
+static void latency_table(FILE *fp)
+{
+	char line[256], stage[16], quant[16];
+	double val, table[L_MAX][4] = { { 0 } };
+	int i, q;
+
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "doorknob_latency_seconds{stage=\"%15[a-z]\",quantile=\"%15[0-9.]\"} %lf",
+				   stage, quant, &val) == 3)
+			q = strcmp(quant, "0.5") == 0 ? 0 : strcmp(quant, "0.99") == 0 ? 1 : 2;
+		else if (sscanf(line, "doorknob_latency_seconds_count{stage=\"%15[a-z]\"} %lf",
+						stage, &val) == 2)
+			q = 3;
+		else
+			continue;
+		for (i = 0; i < L_MAX; ++i)
+			if (strcmp(stage, stages[i]) == 0)
+				table[i][q] = val;
+	}
+
+	printf("%-10s %10s %10s %10s %10s\n", "stage", "count", "p50", "p99", "p999");
+	for (i = 0; i < L_MAX; ++i)
+		printf("%-10s %10.0f %9.3fs %9.3fs %9.3fs\n", stages[i],
+			   table[i][3], table[i][0], table[i][1], table[i][2]);
+}
+
+/* doorknob -m: print what the running daemon has */
+int metrics_dump(const char *path, int latency)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	char buf[4096];
+	int n;
+
+	strlcpy(addr.sun_path, path, sizeof(addr.sun_path));
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return 1;
+	}
+
+	if (latency) {
+		FILE *fp = fdopen(fd, "r");
+		latency_table(fp);
+		fclose(fp);
+		return 0;
+	}
+
+	while ((n = read(fd, buf, sizeof(buf))) > 0)
+		fwrite(buf, 1, n, stdout);
+
+	close(fd);
+	return 0;
+}
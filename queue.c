@@ -0,0 +1,563 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#include "doorknob.h"
+
+/* Every file in the queue has an entry here, named by its path
+ * relative to the queue directory. Entries that
+ * are waiting to be sent are kept in a min-heap ordered by when they
+ * are due and then by the time sendmail queued them, which is encoded
+ * in the file name (sec.usec.pid). So new mail goes out oldest first.
+ * Entries handed out to a session are out of the heap but stay in the
+ * hash so a rescan or a duplicate event doesn't queue them twice.
+ *
+ * Every entry with a stamp is also in a second min-heap ordered by the
+ * stamp alone, so the age of the oldest message is cheap to find.
+ *
+ * A message that failed has a hidden .<name> file next to it with the
+ * number of attempts and the time of the next one, so a restart does
+ * not retry everything at once.
+ */
+struct qent {
+	struct qent *next;   // hash chain
+	long long due;       // when it may go, new mail when it arrived
+	long long stamp;     // usecs from the file name
+	int heap;            // index in the heap, -1 if in flight
+	int age;             // index in ages, -1 if no stamp
+	int attempts;        // failed deliveries
+	char name[];
+};
+
+/* Backoff in seconds */
+static int retry_min = 60;
+static int retry_max = 3600;
+
+static struct qent **hash;
+static unsigned hash_size, count;
+
+static struct qent **heap;
+static unsigned heap_len, heap_size;
+
+static struct qent **ages;
+static unsigned ages_len, ages_size;
+
+static int hashed;
+static int top_wd = -1;
+static int dir_wd[QUEUE_DIRS];
+
+static unsigned hash_name(const char *name)
+{
+	return queue_hash(name) & (hash_size - 1);
+}
+
+static const char *base(const char *path)
+{
+	const char *p = strrchr(path, '/');
+	return p ? p + 1 : path;
+}
+
+static struct qent *lookup(const char *name)
+{
+	struct qent *e;
+
+	if (hash_size == 0)
+		return NULL;
+
+	for (e = hash[hash_name(name)]; e; e = e->next)
+		if (strcmp(e->name, name) == 0)
+			return e;
+	return NULL;
+}
+
+static void *must_alloc(void *ptr, size_t size)
+{
+	ptr = realloc(ptr, size);
+	if (!ptr) {
+		logmsg("Out of memory!");
+		exit(1);
+	}
+	return ptr;
+}
+
+static void hash_grow(void)
+{
+	struct qent **old = hash, *e, *next;
+	unsigned i, old_size = hash_size;
+
+	hash_size = hash_size ? hash_size * 2 : 1024;
+	hash = calloc(hash_size, sizeof(struct qent *));
+	if (!hash) {
+		logmsg("Out of memory!");
+		exit(1);
+	}
+
+	for (i = 0; i < old_size; ++i)
+		for (e = old[i]; e; e = next) {
+			next = e->next;
+			unsigned h = hash_name(e->name);
+			e->next = hash[h];
+			hash[h] = e;
+		}
+
+	free(old);
+}
+
+static int before(struct qent *a, struct qent *b)
+{
+	if (a->due != b->due)
+		return a->due < b->due;
+	if (a->stamp != b->stamp)
+		return a->stamp < b->stamp;
+	return strcmp(a->name, b->name) < 0;
+}
+
+static void heap_set(unsigned i, struct qent *e)
+{
+	heap[i] = e;
+	e->heap = i;
+}
+
+static void heap_up(unsigned i)
+{
+	struct qent *e = heap[i];
+
+	while (i > 0) {
+		unsigned parent = (i - 1) / 2;
+		if (!before(e, heap[parent]))
+			break;
+		heap_set(i, heap[parent]);
+		i = parent;
+	}
+	heap_set(i, e);
+}
+
+static void heap_down(unsigned i)
+{
+	struct qent *e = heap[i];
+
+	while (1) {
+		unsigned child = 2 * i + 1;
+		if (child >= heap_len)
+			break;
+		if (child + 1 < heap_len && before(heap[child + 1], heap[child]))
+			++child;
+		if (!before(heap[child], e))
+			break;
+		heap_set(i, heap[child]);
+		i = child;
+	}
+	heap_set(i, e);
+}
+
+static void heap_push(struct qent *e)
+{
+	if (heap_len == heap_size) {
+		heap_size = heap_size ? heap_size * 2 : 1024;
+		heap = must_alloc(heap, heap_size * sizeof(struct qent *));
+	}
+	heap_set(heap_len, e);
+	heap_up(heap_len++);
+}
+
+static struct qent *heap_pop(void)
+{
+	struct qent *e = heap[0];
+
+	if (--heap_len) {
+		heap_set(0, heap[heap_len]);
+		heap_down(0);
+	}
+	e->heap = -1;
+	return e;
+}
+
+static void age_set(unsigned i, struct qent *e)
+{
+	ages[i] = e;
+	e->age = i;
+}
+
+static void age_up(unsigned i)
+{
+	struct qent *e = ages[i];
+
+	while (i > 0) {
+		unsigned parent = (i - 1) / 2;
+		if (ages[parent]->stamp <= e->stamp)
+			break;
+		age_set(i, ages[parent]);
+		i = parent;
+	}
+	age_set(i, e);
+}
+
+static void age_down(unsigned i)
+{
+	struct qent *e = ages[i];
+
+	while (1) {
+		unsigned child = 2 * i + 1;
+		if (child >= ages_len)
+			break;
+		if (child + 1 < ages_len && ages[child + 1]->stamp < ages[child]->stamp)
+			++child;
+		if (e->stamp <= ages[child]->stamp)
+			break;
+		age_set(i, ages[child]);
+		i = child;
+	}
+	age_set(i, e);
+}
+
+static void age_push(struct qent *e)
+{
+	if (ages_len == ages_size) {
+		ages_size = ages_size ? ages_size * 2 : 1024;
+		ages = must_alloc(ages, ages_size * sizeof(struct qent *));
+	}
+	age_set(ages_len, e);
+	age_up(ages_len++);
+}
+
+static void age_remove(struct qent *e)
+{
+	unsigned i = e->age;
+	struct qent *last = ages[--ages_len];
+
+	if (i < ages_len) {
+		age_set(i, last);
+		age_down(i);
+		age_up(last->age);
+	}
+}
+
+static void retry_path(char *path, int len, const char *name)
+{
+	const char *b = base(name);
+	snprintf(path, len, "%.*s.%s", (int)(b - name), name, b);
+}
+
+/* Returns the due time from the retry file, now if there isn't one */
+static long long retry_load(struct qent *e, long long now)
+{
+	char path[NAME_MAX + 6];
+	long long when;
+
+	retry_path(path, sizeof(path), e->name);
+	FILE *fp = fopen(path, "r");
+	if (!fp)
+		return now;
+
+	if (fscanf(fp, "%d %lld", &e->attempts, &when) != 2) {
+		e->attempts = 0;
+		when = 0;
+	}
+	fclose(fp);
+
+	if (when <= time(NULL))
+		return now;
+	return now + (when - time(NULL)) * 1000;
+}
+
+static void retry_save(struct qent *e, long long now)
+{
+	char path[NAME_MAX + 6];
+
+	retry_path(path, sizeof(path), e->name);
+	FILE *fp = fopen(path, "w");
+	if (!fp) {
+		logmsg("%s: %s", path, strerror(errno));
+		return;
+	}
+
+	fprintf(fp, "%d %lld\n", e->attempts,
+			(long long)time(NULL) + (e->due - now + 999) / 1000);
+	if (fclose(fp))
+		logmsg("%s: %s", path, strerror(errno));
+}
+
+/* retried is set if the name may have a retry file */
+static void add(const char *name, long long now, int retried)
+{
+	if (*base(name) == '.' || lookup(name))
+		return;
+
+	if (count >= hash_size)
+		hash_grow();
+
+	struct qent *e = must_alloc(NULL, sizeof(struct qent) + strlen(name) + 1);
+	strcpy(e->name, name);
+	e->attempts = 0;
+	// Not 0 for new mail, or a steady stream of it would keep
+	// messages that are due for a retry waiting forever
+	e->due = retried ? retry_load(e, now) : now;
+
+	char *p;
+	e->stamp = strtoll(base(name), &p, 10) * 1000000;
+	if (*p == '.')
+		e->stamp += strtol(p + 1, NULL, 10);
+	e->age = -1;
+	if (e->stamp)
+		age_push(e);
+
+	unsigned h = hash_name(name);
+	e->next = hash[h];
+	hash[h] = e;
+	++count;
+
+	heap_push(e);
+}
+
+static int is_subdir(const char *name)
+{
+	return strlen(name) == 2 && isxdigit(name[0]) && isxdigit(name[1]);
+}
+
+/* Move a flat file, and its retry file, into its hashed directory */
+static int migrate(const char *name, char *path, int len)
+{
+	char from[NAME_MAX + 2], to[NAME_MAX + 6];
+
+	queue_path(path, len, name, 1);
+
+	snprintf(from, sizeof(from), ".%s", name);
+	retry_path(to, sizeof(to), path);
+	if (rename(from, to) && errno != ENOENT)
+		logmsg("rename %s: %s", from, strerror(errno));
+
+	if (rename(name, path)) {
+		logmsg("rename %s: %s", name, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/* Watch the queue for new files. If asked for, switch a flat queue to
+ * the hashed layout. The directories and watches are set up before
+ * the marker is created so nothing sendmail writes is missed.
+ */
+void queue_watch(int fd, int want_hashed)
+{
+	char dir[4];
+	int i;
+
+	top_wd = inotify_add_watch(fd, ".", IN_CLOSE_WRITE | IN_MOVED_TO);
+	if (top_wd < 0) {
+		logmsg("inotify_add_watch: %s", strerror(errno));
+		exit(1);
+	}
+
+	hashed = access(QUEUE_HASHED, F_OK) == 0;
+	if (!hashed && !want_hashed)
+		return;
+
+	for (i = 0; i < QUEUE_DIRS; ++i) {
+		snprintf(dir, sizeof(dir), "%02x", i);
+		if (mkdir(dir, 0777) == 0)
+			chmod(dir, 0777); // like queue, anybody can drop mail in
+		else if (errno != EEXIST) {
+			logmsg("mkdir %s: %s", dir, strerror(errno));
+			exit(1);
+		}
+
+		dir_wd[i] = inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO);
+		if (dir_wd[i] < 0) {
+			logmsg("inotify_add_watch %s: %s", dir, strerror(errno));
+			exit(1);
+		}
+	}
+
+	if (!hashed) {
+		// The files already queued are moved by queue_scan()
+		int mfd = open(QUEUE_HASHED, O_WRONLY | O_CREAT, 0644);
+		if (mfd < 0) {
+			logmsg(QUEUE_HASHED ": %s", strerror(errno));
+			exit(1);
+		}
+		close(mfd);
+		hashed = 1;
+		logmsg("Switched to a hashed queue");
+	}
+}
+
+/* A file showed up in the queue. Dot files are ours or sendmail's,
+ * and names we already know about are ignored. A new file can't have
+ * a retry file yet.
+ */
+void queue_notify(int wd, const char *name, long long now)
+{
+	char path[NAME_MAX + 6];
+	int i;
+
+	if (wd == top_wd) {
+		if (*name == '.' || is_subdir(name))
+			return;
+		if (!hashed)
+			add(name, now, 0);
+		else if (!lookup(name) && migrate(name, path, sizeof(path)) == 0)
+			add(path, now, 0); // sendmail raced the switch
+		return;
+	}
+
+	for (i = 0; i < QUEUE_DIRS; ++i)
+		if (dir_wd[i] == wd) {
+			snprintf(path, sizeof(path), "%02x/%s", i, name);
+			add(path, now, 0);
+			return;
+		}
+}
+
+static void scan_dir(const char *dir, long long now)
+{
+	char path[NAME_MAX + 6];
+	struct dirent *ent;
+
+	DIR *d = opendir(dir);
+	if (!d) {
+		logmsg("opendir %s: %s", dir, strerror(errno));
+		return;
+	}
+
+	while ((ent = readdir(d))) {
+		const char *name = ent->d_name;
+		if (*name == '.')
+			continue;
+		if (strcmp(dir, ".")) {
+			snprintf(path, sizeof(path), "%s/%s", dir, name);
+			add(path, now, 1);
+		} else if (!hashed)
+			add(name, now, 1);
+		else if (!is_subdir(name) && !lookup(name) &&
+				 migrate(name, path, sizeof(path)) == 0)
+			add(path, now, 1);
+	}
+
+	closedir(d);
+}
+
+/* Pick up anything we missed, e.g. at startup or after the inotify
+ * queue overflowed. With a hashed queue this also finishes moving any
+ * flat files.
+ */
+void queue_scan(long long now)
+{
+	char dir[4];
+	int i;
+
+	scan_dir(".", now);
+
+	if (hashed)
+		for (i = 0; i < QUEUE_DIRS; ++i) {
+			snprintf(dir, sizeof(dir), "%02x", i);
+			scan_dir(dir, now);
+		}
+}
+
+/* Returns the next message due by now, or NULL. The name stays valid
+ * until queue_done() or queue_retry().
+ */
+char *queue_next(long long now)
+{
+	if (heap_len == 0 || heap[0]->due > now)
+		return NULL;
+	return heap_pop()->name;
+}
+
+/* Returns when the next message is due, -1 if there are none */
+long long queue_due(void)
+{
+	return heap_len ? heap[0]->due : -1;
+}
+
+/* The message has been sent or is gone */
+void queue_done(const char *name)
+{
+	struct qent **pp, *e;
+
+	if (hash_size == 0)
+		return;
+
+	for (pp = &hash[hash_name(name)]; (e = *pp); pp = &e->next)
+		if (strcmp(e->name, name) == 0) {
+			*pp = e->next;
+			if (e->heap >= 0) {
+				// Only happens if it was not handed out
+				unsigned i = e->heap;
+				struct qent *last = heap[--heap_len];
+				if (i < heap_len) {
+					heap_set(i, last);
+					heap_down(i);
+					heap_up(last->heap);
+				}
+			}
+			if (e->age >= 0)
+				age_remove(e);
+			if (e->attempts) {
+				char path[NAME_MAX + 6];
+				retry_path(path, sizeof(path), e->name);
+				unlink(path);
+			}
+			free(e);
+			--count;
+			return;
+		}
+}
+
+void queue_set_retry(int min, int max)
+{
+	retry_min = min;
+	retry_max = max;
+}
+
+/* Put a message handed out by queue_next() back for later. The wait
+ * doubles with each attempt up to retry_max, and is jittered down by
+ * up to half so messages that failed together spread out.
+ */
+void queue_retry(const char *name, long long now)
+{
+	struct qent *e = lookup(name);
+
+	if (!e || e->heap >= 0)
+		return;
+
+	int shift = e->attempts < 20 ? e->attempts : 20;
+	long long delay = (long long)retry_min << shift;
+	if (delay > retry_max)
+		delay = retry_max;
+	delay *= 1000;
+	delay -= random() % (delay / 2 + 1);
+
+	++e->attempts;
+	e->due = now + delay;
+	heap_push(e);
+	retry_save(e, now);
+}
+
+/* When sendmail queued the message, in usecs since the epoch, from
+ * its name. 0 if the name doesn't say.
+ */
+long long queue_stamp(const char *name)
+{
+	struct qent *e = lookup(name);
+	return e ? e->stamp : 0;
+}
+
+/* Number of messages in the queue, including in flight */
+unsigned queue_count(void)
+{
+	return count;
+}
+
+/* When the oldest message was queued, in seconds, 0 if none */
+long long queue_oldest(void)
+{
+	return ages_len ? ages[0]->stamp / 1000000 : 0;
+}
@@ -17,6 +17,7 @@
  * Boston, MA 02111-1307, USA.
  */
 
+#define _GNU_SOURCE // syncfs
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -30,17 +31,28 @@
 #include <sys/time.h>
 #include <sys/stat.h>
 
+#include "doorknob.h"
+
 #define MAX_QNAME (20 + 6 + 10 + 3) // includes the NULL
 
 static char tmp_path[MAX_QNAME + 4];
-static char real_path[MAX_QNAME + 6];
+static char real_path[MAX_QNAME + 9];
+static int queue_dir; // of real_path, -1 if not hashed
 
 static int create_tmp_file(void)
 {
+	static struct timeval last;
+	static int hashed = -1;
 	char tmp_file[MAX_QNAME];
 	struct timeval now;
 
 	gettimeofday(&now, NULL);
+	// A batch can make several a microsecond, keep the names unique
+	if (timercmp(&now, &last, <=)) {
+		struct timeval one = { 0, 1 };
+		timeradd(&last, &one, &now);
+	}
+	last = now;
 #ifdef __QNX__
 	snprintf(tmp_file, sizeof(tmp_file), "%lu.%06d.%d",
 			 now.tv_sec, now.tv_usec, getpid());
@@ -50,7 +62,13 @@ static int create_tmp_file(void)
 #endif
 
 	snprintf(tmp_path, sizeof(tmp_path), "tmp/%s", tmp_file);
-	snprintf(real_path, sizeof(real_path), "queue/%s", tmp_file);
+
+	if (hashed < 0)
+		hashed = access("queue/" QUEUE_HASHED, F_OK) == 0;
+	char qpath[MAX_QNAME + 3];
+	queue_path(qpath, sizeof(qpath), tmp_file, hashed);
+	snprintf(real_path, sizeof(real_path), "queue/%s", qpath);
+	queue_dir = hashed ? queue_hash(tmp_file) % QUEUE_DIRS : -1;
 
 	/* Yes, it must be world writable for doorknob. This file is
 	 * protected by the directory permissions.
@@ -75,149 +93,561 @@ static int my_write(int fd, const void *buf, size_t len)
 }
 
 
-/* This is good for well over 1000 tos */
+/* Messages written to tmp/ by a batch but not yet in the queue */
+#define MAX_BATCH 256
+
+static struct {
+	char tmp[MAX_QNAME + 4];
+	char real[MAX_QNAME + 9];
+	int dir;
+} batch[MAX_BATCH];
+static int nbatch, queued, batching;
+
+/* In a batch a bad message is skipped rather than fatal */
+static const char *bad;
+static int skipped;
+
+static void die(const char *msg)
+{
+	fprintf(stderr, "%s\n", msg);
+	unlink(tmp_path);
+	for (int i = 0; i < nbatch; ++i)
+		unlink(batch[i].tmp);
+	if (batching)
+		fprintf(stderr, "%d messages queued\n", queued);
+	exit(1);
+}
+
+/* The message is malformed. Only the first reason is kept. */
+static void reject(const char *msg)
+{
+	if (!batching)
+		die(msg);
+	if (!bad)
+		bad = msg;
+}
+
+/* Make a rename into the queue directory durable */
+static int sync_dir(int dir)
+{
+	char path[16];
+
+	if (dir < 0)
+		strcpy(path, "queue");
+	else
+		snprintf(path, sizeof(path), "queue/%02x", dir);
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	int rc = fsync(fd);
+	close(fd);
+	return rc;
+}
+
+/* Chunks of stdin. Also the body copy buffer. */
 static char buff[64 * 1024];
-static int blen;
 
-static void out_one(const char *to, int fd)
+/* sendmail -t has to write the recipients before the header, so the
+ * header is held here until the blank line. A header too big for
+ * this spills to an unlinked file in tmp/, so memory use does not
+ * grow with the header.
+ */
+static char held[64 * 1024];
+static int hlen, spill = -1;
+
+static void header_hold(const char *p, int len)
 {
-	if (*to) {
-		int len = strlen(to);
-		my_write(fd, to, len);
-		my_write(fd, "\n", 1);
+	if (hlen + len <= sizeof(held)) {
+		memcpy(held + hlen, p, len);
+		hlen += len;
+		return;
+	}
+
+	if (spill < 0) {
+		char fname[] = "tmp/hdr.XXXXXX";
+		spill = mkstemp(fname);
+		if (spill < 0)
+			die("Unable to create header spill file");
+		unlink(fname);
+	}
+	if (write(spill, held, hlen) != hlen || write(spill, p, len) != len)
+		die("Header spill write error");
+	hlen = 0;
+}
+
+/* Recipients are batched rather than a write() each */
+static char rcpts[4096];
+static int rlen;
+
+static void rcpt_flush(int fd)
+{
+	my_write(fd, rcpts, rlen);
+	rlen = 0;
+}
+
+enum { H_LINE, H_NAME, H_VALUE };
+enum { F_OTHER, F_RCPT, F_FROM, F_DATE };
+
+struct header {
+	int state;
+	int field;
+	char name[8];
+	int nlen;
+	int count, saw_from, saw_date;
+
+	// The address being parsed out of a To, Cc or Bcc field
+	char to[MAX_ADDR];
+	int tlen;
+	int toolong;
+	int quoted, comment, escape;
+	int angle;  // inside <>
+	int done;   // had the <>, ignore the rest up to the comma
+};
+
+static void addr_add(struct header *h, int c)
+{
+	if (h->tlen < sizeof(h->to) - 2)
+		h->to[h->tlen++] = c;
+	else
+		h->toolong = 1;
+}
+
+static void addr_out(struct header *h, int fd)
+{
+	if (h->toolong)
+		reject("Address too long");
+	else if (h->tlen) {
+		h->to[h->tlen++] = '\n';
+		if (rlen + h->tlen >= sizeof(rcpts)) // room for the blank line
+			rcpt_flush(fd);
+		memcpy(rcpts + rlen, h->to, h->tlen);
+		rlen += h->tlen;
+		++h->count;
 	}
+	h->tlen = 0;
+	h->done = 0;
 }
 
-#define RESET do {								\
-		p = to;									\
-		*p = 0;									\
-		++line;									\
-		while (*line == ' ' || *line == '\t')	\
-			++line;								\
-	} while (0)
+/* One character of an address list. Handles display names, quoted
+ * strings, comments, <> and groups. Folding is just whitespace.
+ */
+static void addr_char(struct header *h, int c, int fd)
+{
+	if (h->escape) {
+		h->escape = 0;
+		if (!h->comment)
+			addr_add(h, c);
+		return;
+	}
+	if (h->comment) {
+		if (c == '\\')
+			h->escape = 1;
+		else if (c == '(')
+			++h->comment;
+		else if (c == ')')
+			--h->comment;
+		return;
+	}
+	if (h->quoted) {
+		if (c == '\r' || c == '\n')
+			return;
+		if (c == '\\')
+			h->escape = 1;
+		else if (c == '"')
+			h->quoted = 0;
+		addr_add(h, c);
+		return;
+	}
+
+	switch (c) {
+	case ' ':
+	case '\t':
+	case '\r':
+	case '\n':
+		break;
+	case '(':
+		h->comment = 1;
+		break;
+	case '"':
+		h->quoted = 1;
+		addr_add(h, c);
+		break;
+	case '<':
+		// Everything so far was the display name
+		h->tlen = h->toolong = 0;
+		h->angle = 1;
+		h->done = 0;
+		break;
+	case '>':
+		if (h->angle) {
+			h->angle = 0;
+			addr_out(h, fd);
+			h->done = 1;
+		}
+		break;
+	case ':':
+		// A group name, or the end of a source route inside <>
+		h->tlen = h->toolong = 0;
+		break;
+	case ',':
+	case ';':
+		if (!h->angle)
+			addr_out(h, fd);
+		break;
+	default:
+		if (!h->done)
+			addr_add(h, c);
+	}
+}
 
-static void output_to(const char *line, int fd)
+static void field_end(struct header *h, int fd)
 {
-	char to[64], *p;
+	if (h->field == F_RCPT) {
+		addr_out(h, fd);
+		h->quoted = h->comment = h->escape = h->angle = 0;
+	}
+	h->field = F_OTHER;
+}
 
-	while (*line != ':')
-		++line;
-	RESET;
+static void field_start(struct header *h)
+{
+	h->name[h->nlen] = 0;
+	if (strcmp(h->name, "to") == 0 || strcmp(h->name, "cc") == 0 ||
+		strcmp(h->name, "bcc") == 0)
+		h->field = F_RCPT;
+	else if (strcmp(h->name, "from") == 0)
+		h->saw_from = 1;
+	else if (strcmp(h->name, "date") == 0)
+		h->saw_date = 1;
+}
 
-	while (*line) {
-		switch (*line) {
-		case '<':
-			RESET;
+/* Feed a chunk of the header to the parser, which writes the
+ * recipients to fd as it finds them and holds the header. Returns
+ * the offset of the blank line that ends the header, or -1 if it
+ * needs more.
+ */
+static int header_feed(struct header *h, const char *buf, int len, int fd)
+{
+	const char *p = buf, *end = buf + len, *nl;
+
+	while (p < end)
+		switch (h->state) {
+		case H_LINE:
+			if (*p == '\n' || *p == '\r') {
+				field_end(h, fd);
+				header_hold(buf, p - buf);
+				return p - buf;
+			}
+			if (*p == ' ' || *p == '\t')
+				h->state = H_VALUE; // folded
+			else {
+				field_end(h, fd);
+				h->nlen = 0;
+				h->state = H_NAME;
+			}
 			break;
-		case '>':
-			*p = 0;
-			out_one(to, fd);
-			RESET;
+
+		case H_NAME:
+			if (*p == ':') {
+				field_start(h);
+				h->state = H_VALUE;
+			} else if (*p == '\n')
+				h->state = H_LINE; // not a field, just keep it
+			else if (*p != ' ' && *p != '\t' && h->nlen < sizeof(h->name) - 1)
+				// Longer names are never one we want
+				h->name[h->nlen++] = tolower((unsigned char)*p);
+			++p;
 			break;
 
-		case ',':
-			*p = 0;
-			out_one(to, fd);
-			RESET;
+		case H_VALUE:
+			nl = memchr(p, '\n', end - p);
+			if (h->field == F_RCPT)
+				for (const char *e = nl ? nl : end; p < e; ++p)
+					addr_char(h, *p, fd);
+			if (!nl) {
+				p = end;
+				break;
+			}
+			p = nl + 1;
+			h->state = H_LINE;
 			break;
+		}
 
-		case '\r':
-		case '\n':
-			*p = 0;
-			out_one(to, fd);
-			return; // done
+	header_hold(buf, len);
+	return -1;
+}
 
-		default:
-			if (p < &to[62])
-				*p++ = *line++;
-			else
-				++line;
+/* The header is done: end the recipients, then write the header
+ * with a From and Date if it was missing them.
+ */
+static void header_finish(struct header *h, int fd)
+{
+	if (h->count == 0)
+		reject("Invalid header");
+	if (bad)
+		return;
+	rcpts[rlen++] = '\n'; // end of recipients
+	rcpt_flush(fd);
+
+	if (spill >= 0) {
+		int n;
+
+		if (write(spill, held, hlen) != hlen || lseek(spill, 0, SEEK_SET))
+			die("Header spill write error");
+		while ((n = read(spill, held, sizeof(held))) > 0)
+			my_write(fd, held, n);
+		if (n)
+			die("Header spill read error");
+		close(spill);
+		spill = -1;
+	} else
+		my_write(fd, held, hlen);
+	hlen = 0;
+
+	if (!h->saw_from)
+		my_write(fd, "From: unknown\n", 14);
+	if (!h->saw_date) {
+		// Date isn't required... but I sort by date
+		time_t now = time(NULL);
+		struct tm *tm = localtime(&now);
+
+		char date[64];
+		strftime(date, sizeof(date), "Date: %a, %d %b %Y %T %z\n", tm);
+		my_write(fd, date, strlen(date));
+	}
+}
+
+/* Look for recipients and output them, then the header. The header
+ * is read a chunk at a time so it can be any size.
+ */
+static void look_for_to(int fd)
+{
+	struct header h = { .state = H_LINE };
+	int n, body;
+
+	hlen = rlen = 0;
+	while ((n = read(0, buff, sizeof(buff))) > 0) {
+		body = header_feed(&h, buff, n, fd);
+		if (body >= 0) {
+			header_finish(&h, fd);
+			// and the start of the body
+			my_write(fd, buff + body, n - body);
+			return;
 		}
 	}
+
+	die(n ? "Read error" : "Invalid header");
 }
 
-static void rewrite_header(int fd)
+/* Group commit: one sync makes the whole batch durable, then it is
+ * moved into the queue and the queue directories are synced.
+ */
+static void batch_commit(void)
 {
-	int saw_from = 0, saw_date = 0;
-
-	const char *line = buff;
-	do {
-		if (*line == '\n')
-			++line;
-
-		if (*line == '\n' || *line == '\r') {
-			// end of header
-			if (!saw_from)
-				my_write(fd, "From: unknown\n", 14);
-			if (!saw_date) {
-				// Date isn't required... but I sort by date
-				time_t now = time(NULL);
-				struct tm *tm = localtime(&now);
-
-				char date[64];
-				strftime(date, sizeof(date), "Date: %a, %d %b %Y %T %z\n", tm);
-				my_write(fd, date, strlen(date));
-			}
+	int i;
 
-			// and the body
-			my_write(fd, line, strlen(line));
-			return;
-		} else {
-			if (strncmp(line, "From:", 5) == 0)
-				saw_from = 1;
-			else if (strncmp(line, "Date:", 5) == 0)
-				saw_date = 1;
-			char *p = strchr(line, '\n');
-			if (p)
-				my_write(fd, line, p - line + 1);
+	if (nbatch == 0)
+		return;
+
+#ifdef __linux__
+	int fd = open("tmp", O_RDONLY);
+	if (fd < 0 || syncfs(fd))
+		die("tmp: sync failed");
+	close(fd);
+#endif
+
+	for (i = 0; i < nbatch; ++i)
+		if (rename(batch[i].tmp, batch[i].real)) {
+			fprintf(stderr, "Unable to rename %s to %s\n", batch[i].tmp, batch[i].real);
+			queued += i;
+			memmove(batch, batch + i, (nbatch - i) * sizeof(batch[0]));
+			nbatch -= i;
+			die("Batch failed");
 		}
-	} while ((line = strchr(line, '\n')));
+
+#ifdef __linux__
+	// syncfs covers all the queue directories at once
+	fd = open("queue", O_RDONLY);
+	if (fd < 0 || syncfs(fd))
+		die("queue: sync failed");
+	close(fd);
+#else
+	char synced[QUEUE_DIRS + 1] = { 0 };
+	for (i = 0; i < nbatch; ++i)
+		if (!synced[batch[i].dir + 1]) {
+			synced[batch[i].dir + 1] = 1;
+			if (sync_dir(batch[i].dir))
+				die("queue: sync failed");
+		}
+#endif
+
+	queued += nbatch;
+	nbatch = 0;
 }
 
-// Look for recipients and output them
-static void look_for_to(int fd)
+static void batch_end(int fd, struct header *h, int in_header, int msgno)
 {
-	int count = 0;
-
-	blen = read(0, buff, sizeof(buff) - 1);
-	if (blen <= 0)
-		goto invalid;
-	buff[blen] = 0;
-
-	const char *line = buff;
-	do {
-		if (*line == '\n')
-			++line;
-
-		if (strncasecmp(line, "To:", 3) == 0 ||
-			strncasecmp(line, "Cc:", 3) == 0 ||
-			strncasecmp(line, "Bcc:", 4) == 0) {
-			// found one
-			++count;
-			output_to(line, fd);
-			continue; // we already should be at EOL
-		} else if (*line == '\n' || *line == '\r') {
-			// end of header
-			if (count == 0)
-				goto invalid;
-			my_write(fd, "\n", 1); // end of recipients
-
-			rewrite_header(fd);
-			return;
+	if (in_header)
+		reject("Invalid header");
+	if (bad) {
+		fprintf(stderr, "Message %d: %s, not queued\n", msgno, bad);
+		close(fd);
+		unlink(tmp_path);
+		*tmp_path = 0;
+		bad = NULL;
+		++skipped;
+		return;
+	}
+	if (total_len != total_write)
+		die("Write error");
+#ifndef __linux__
+	if (fsync(fd))
+		die("Write error");
+#endif
+	close(fd);
+
+	strcpy(batch[nbatch].tmp, tmp_path);
+	strcpy(batch[nbatch].real, real_path);
+	batch[nbatch].dir = queue_dir;
+	*tmp_path = 0;
+	if (++nbatch == MAX_BATCH)
+		batch_commit();
+}
+
+/* The rest of stdin is read through buff[bpos..bend] a line at a time */
+static int bpos, bend, scan, at_sol = 1;
+
+/* The next line of stdin, or as much of it as fits in buff. sol is
+ * set if it is the start of a line. Returns 0 at EOF.
+ */
+static int next_line(const char **line, int *sol)
+{
+	char *nl;
+	int n;
+
+	while (!(nl = memchr(buff + scan, '\n', bend - scan))) {
+		if (bpos > 0) {
+			memmove(buff, buff + bpos, bend - bpos);
+			bend -= bpos;
+			bpos = 0;
 		}
-	} while ((line = strchr(line, '\n')));
+		scan = bend;
+		if (bend == sizeof(buff))
+			break;
+		n = read(0, buff + bend, sizeof(buff) - bend);
+		if (n < 0)
+			die("Read error");
+		if (n == 0)
+			break;
+		bend += n;
+	}
 
-invalid:
-	fputs("Invalid header\n", stderr);
-	exit(1);
+	n = (nl ? nl + 1 - buff : bend) - bpos;
+	*line = buff + bpos;
+	*sol = at_sol;
+	at_sol = nl != NULL;
+	bpos += n;
+	scan = bpos;
+	return n;
+}
+
+/* sendmail -bB: queue every message in an mbox on stdin, each as if
+ * by sendmail -t. ">From " lines are unquoted as in mboxrd. A message
+ * with a bad header is left out and the rest still queued. Returns
+ * the exit status, 1 if any were left out.
+ */
+static int batch_run(void)
+{
+	struct header h;
+	const char *line, *p;
+	int len, sol, fd = -1, in_header = 0, skip = 0, blank = 0, msgno = 0;
+
+	batching = 1;
+	while ((len = next_line(&line, &sol)) > 0) {
+		if (!sol) {
+			if (skip)
+				continue; // the rest of a long From line
+		} else if (len >= 5 && memcmp(line, "From ", 5) == 0) {
+			if (fd >= 0)
+				batch_end(fd, &h, in_header, msgno);
+			fd = create_tmp_file();
+			total_len = total_write = 0;
+			memset(&h, 0, sizeof(h));
+			h.state = H_LINE;
+			hlen = rlen = 0;
+			if (spill >= 0) {
+				close(spill);
+				spill = -1;
+			}
+			++msgno;
+			in_header = 1;
+			blank = 0;
+			skip = line[len - 1] != '\n';
+			continue;
+		} else if (*line == '>') {
+			for (p = line; p < line + len && *p == '>'; ++p)
+				;
+			if (line + len - p >= 5 && memcmp(p, "From ", 5) == 0) {
+				++line;
+				--len;
+			}
+		}
+		skip = 0;
+
+		if (fd < 0)
+			die("Not an mbox");
+		if (bad)
+			continue; // up to the next From
+
+		if (in_header) {
+			int body = header_feed(&h, line, len, fd);
+			if (body < 0)
+				continue;
+			header_finish(&h, fd);
+			in_header = 0;
+			if (bad)
+				continue;
+			line += body;
+			len -= body;
+		}
+
+		// The blank line before the next From is not part of the message
+		if (blank) {
+			my_write(fd, "\n", 1);
+			blank = 0;
+		}
+		if (sol && len == 1 && *line == '\n')
+			blank = 1;
+		else
+			my_write(fd, line, len);
+	}
+
+	if (fd >= 0)
+		batch_end(fd, &h, in_header, msgno);
+	batch_commit();
+
+	if (skipped) {
+		fprintf(stderr, "%d messages queued, %d not queued\n", queued, skipped);
+		return 1;
+	}
+	return 0;
 }
 
 int main(int argc, char *argv[])
 {
-	int c, n, evil_t = 0, from_opt = 0;
+	int c, n, evil_t = 0, from_opt = 0, batch_mode = 0;
 
-	while ((c = getopt(argc, argv, "f:F:io:r:t")) != EOF)
+	while ((c = getopt(argc, argv, "b:f:F:io:r:t")) != EOF)
 		switch (c) {
+		case 'b':
+			if (strcmp(optarg, "B") == 0)
+				evil_t = batch_mode = 1;
+			else if (strcmp(optarg, "m")) {
+				fprintf(stderr, "Only -bm and -bB are supported\n");
+				exit(1);
+			}
+			break;
 		case 'f':
 			from_opt = 1;
 			break;
@@ -257,6 +687,9 @@ int main(int argc, char *argv[])
 		gethostname(hostname, 100);
 	}
 
+	if (batch_mode)
+		return batch_run();
+
 	int fd = create_tmp_file();
 
 	if (evil_t)
@@ -305,6 +738,10 @@ int main(int argc, char *argv[])
 		exit(1);
 	}
 
+	// It is queued now, but only safe once the directory is on disk
+	if (sync_dir(queue_dir))
+		perror("queue: fsync");
+
 	return 0;
 
 write_error: